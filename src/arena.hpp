@@ -0,0 +1,292 @@
+#ifndef INCLUDED_ARENA_HPP
+#define INCLUDED_ARENA_HPP
+
+#ifdef _WIN32
+// Keep windows.h from defining min/max macros over std::min/std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace echolocator_detail {
+
+template <typename T>
+class arena_array {
+	T *p;
+	std::size_t n;
+
+public:
+	inline arena_array(void) : p(nullptr), n(0) {}
+	inline arena_array(T *data, std::size_t size) : p(data), n(size) {}
+
+	inline T *data(void) {
+		return p;
+	}
+
+	inline const T *data(void) const {
+		return p;
+	}
+
+	inline std::size_t size(void) const {
+		return n;
+	}
+
+	inline bool empty(void) const {
+		return n == 0;
+	}
+
+	inline T &operator[](std::size_t i) {
+		return p[i];
+	}
+
+	inline const T &operator[](std::size_t i) const {
+		return p[i];
+	}
+};
+
+enum class arena_section {
+	input, // recorded samples
+	work, // per-batch scratch (FFT buffers, copies of input)
+	coefficients, // filters, spectra and delay lines
+	raw, // frames of each kind, for every searcher in turn
+	envelope,
+	phase,
+	background,
+	targets // echoes and tracks published with each frame
+};
+
+class arena {
+	// All pipeline state in one block. The pipeline is built twice:
+	// while measuring, requests are served from the heap and totalled
+	// per section; reserve() then maps a single block and the second
+	// build is served from it. Each section is contiguous, so like
+	// buffers from every searcher sit side by side (e.g. all envelope
+	// frames together, as a renderer reads them).
+	static const std::size_t SECTIONS = 8;
+	static const std::size_t CACHE_LINE = 64;
+	static const std::size_t PAGE = 4096;
+	static const std::size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+	struct shared_block {
+		std::size_t section;
+		std::uint64_t key;
+		std::size_t bytes;
+		void *data;
+	};
+
+	std::vector<void*> loose;
+	std::vector<shared_block> shared;
+	std::size_t sizes[SECTIONS];
+	std::size_t offsets[SECTIONS];
+	std::size_t cursors[SECTIONS];
+	unsigned char *block;
+	void *mapping;
+	std::size_t mappingSize;
+
+	static std::size_t round_up(std::size_t v, std::size_t alignment) {
+		return (v + alignment - 1) / alignment * alignment;
+	}
+
+	static void *allocate_loose(std::size_t bytes) {
+		void *p = nullptr;
+#ifdef _WIN32
+		p = _aligned_malloc(bytes, CACHE_LINE);
+#else
+		if(posix_memalign(&p, CACHE_LINE, bytes) != 0) {
+			p = nullptr;
+		}
+#endif
+		if(p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	static void free_loose(void *p) {
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+
+	static void *map_block(std::size_t bytes) {
+		// Fresh pages, which the system zeroes
+#ifdef _WIN32
+		void *p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		void *p = mmap(
+			nullptr,
+			bytes,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON,
+			-1,
+			0
+		);
+		if(p == MAP_FAILED) {
+			p = nullptr;
+		}
+#endif
+		if(p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	static void unmap_block(void *p, std::size_t bytes) {
+#ifdef _WIN32
+		(void) bytes;
+		VirtualFree(p, 0, MEM_RELEASE);
+#else
+		munmap(p, bytes);
+#endif
+	}
+
+	void release(void) {
+		for(std::size_t i = 0; i < loose.size(); ++ i) {
+			free_loose(loose[i]);
+		}
+		loose.clear();
+		shared.clear();
+		if(mapping != nullptr) {
+			unmap_block(mapping, mappingSize);
+			mapping = nullptr;
+		}
+		block = nullptr;
+		mappingSize = 0;
+	}
+
+public:
+	arena(void)
+		: loose()
+		, shared()
+		, block(nullptr)
+		, mapping(nullptr)
+		, mappingSize(0)
+	{
+		reset();
+	}
+
+	arena(const arena&) = delete;
+	arena &operator=(const arena&) = delete;
+
+	void reset(void) {
+		// Back to measuring; everything handed out so far is invalid
+		release();
+		for(std::size_t i = 0; i < SECTIONS; ++ i) {
+			sizes[i] = 0;
+			offsets[i] = 0;
+			cursors[i] = 0;
+		}
+	}
+
+	template <typename T>
+	arena_array<T> allocate(arena_section section, std::size_t count) {
+		// Zeroed and cache-line aligned (only for plain data types)
+		std::size_t s = std::size_t(section);
+		std::size_t bytes = round_up(count * sizeof(T), CACHE_LINE);
+		if(count == 0) {
+			return arena_array<T>();
+		}
+		if(block == nullptr) {
+			void *p = allocate_loose(bytes);
+			memset(p, 0, bytes);
+			loose.push_back(p);
+			sizes[s] += bytes;
+			return arena_array<T>(static_cast<T*>(p), count);
+		}
+		if(cursors[s] + bytes > sizes[s]) {
+			throw std::runtime_error("arena requests changed after measuring");
+		}
+		T *p = reinterpret_cast<T*>(block + offsets[s] + cursors[s]);
+		cursors[s] += bytes;
+		return arena_array<T>(p, count);
+	}
+
+	template <typename T>
+	arena_array<T> allocate_shared(
+		arena_section section,
+		std::uint64_t key,
+		std::size_t count,
+		bool &fresh
+	) {
+		// One block per (section, key, size), e.g. tables which many
+		// objects read; fresh is set when the caller must fill it
+		std::size_t s = std::size_t(section);
+		std::size_t bytes = count * sizeof(T);
+		for(std::size_t i = 0; i < shared.size(); ++ i) {
+			const shared_block &b = shared[i];
+			if(b.section == s && b.key == key && b.bytes == bytes) {
+				fresh = false;
+				return arena_array<T>(static_cast<T*>(b.data), count);
+			}
+		}
+		arena_array<T> a = allocate<T>(section, count);
+		shared_block b = {s, key, bytes, a.data()};
+		shared.push_back(b);
+		fresh = true;
+		return a;
+	}
+
+	void reserve(bool hugePages) {
+		// Replace the measuring allocations with one block. Sections
+		// start on page boundaries so that they never share a page.
+		std::size_t page = PAGE;
+		if(hugePages) {
+			page = HUGE_PAGE;
+		}
+		std::size_t total = 0;
+		for(std::size_t i = 0; i < SECTIONS; ++ i) {
+			offsets[i] = total;
+			cursors[i] = 0;
+			total += round_up(sizes[i], PAGE);
+		}
+		if(total == 0) {
+			total = PAGE;
+		}
+		total = round_up(total, page);
+		release();
+
+		// Over-map so that the block itself can start on a huge page
+		mappingSize = total + (hugePages ? page : 0);
+		mapping = map_block(mappingSize);
+		std::uintptr_t start = reinterpret_cast<std::uintptr_t>(mapping);
+		block = reinterpret_cast<unsigned char*>(round_up(start, page));
+#ifdef MADV_HUGEPAGE
+		if(hugePages) {
+			madvise(block, total, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	std::size_t size(void) const {
+		std::size_t total = 0;
+		for(std::size_t i = 0; i < SECTIONS; ++ i) {
+			total += sizes[i];
+		}
+		return total;
+	}
+
+	~arena(void) {
+		release();
+	}
+};
+
+}
+
+#endif
@@ -1,26 +1,43 @@
 #include "audio.hpp"
+#include "arena.hpp"
 #include "fourier.hpp"
 #include "chirps.hpp"
+#include "hadamard.hpp"
+#include "tracker.hpp"
 
 #include <portaudio.h>
-#include <fftw3.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 
 #include <iostream> // debug only
 
+// Everything but the public interface stays private to the library,
+// so that it cannot clash with a host program's own names
+namespace {
+
+using namespace echolocator_detail;
+
 const double SPEED_OF_SOUND = 340.0; // metres/second
 
 class recorder {
-	std::vector<double> memory;
+	arena_array<double> memory;
 	std::size_t position;
 	std::size_t total;
 
 public:
-	recorder(std::size_t capacity)
-		: memory(capacity, 0.0)
+	recorder(std::size_t capacity, arena &space)
+		: memory(space.allocate<double>(arena_section::input, capacity))
 		, position(0)
 		, total(0)
 	{}
@@ -48,64 +65,280 @@ public:
 	}
 };
 
+class arena_radix2_tables : public radix2_table_source {
+	// One set of built-in FFT tables per size, shared by every engine
+	static const std::uint64_t SHARED_ORDER = 1;
+	static const std::uint64_t SHARED_TWIDDLES = 2;
+
+	arena &space;
+
+public:
+	explicit arena_radix2_tables(arena &s) : space(s) {}
+
+	radix2_tables tables(std::size_t size) {
+		bool freshOrder = false;
+		bool freshTwiddles = false;
+		arena_array<std::size_t> order = space.allocate_shared<std::size_t>(
+			arena_section::coefficients, SHARED_ORDER, size, freshOrder
+		);
+		arena_array<fft_complex> twiddles = space.allocate_shared<fft_complex>(
+			arena_section::coefficients, SHARED_TWIDDLES, size, freshTwiddles
+		);
+		if(freshOrder || freshTwiddles) {
+			radix2_tables::fill(size, order.data(), twiddles.data());
+		}
+		radix2_tables t = {order.data(), twiddles.data()};
+		return t;
+	}
+};
+
+fft arena_fft(
+	arena &space,
+	std::size_t size,
+	fft_backend backend = fft_backend::automatic
+) {
+	arena_array<fft_complex> p = space.allocate<fft_complex>(arena_section::work, size);
+	arena_array<fft_complex> f = space.allocate<fft_complex>(arena_section::work, size);
+	arena_array<fft_complex> scratch = space.allocate<fft_complex>(
+		arena_section::work,
+		fft_scratch_size(size, backend)
+	);
+	arena_radix2_tables tables(space);
+	return fft(size, p.data(), f.data(), backend, scratch.data(), &tables);
+}
+
 class searcher {
+public:
+	static const std::size_t FRAME_SLOTS = 3;
+	static const std::size_t MAX_ECHOES = 16;
+
+protected:
 	const recorder *r;
-	fft transformer;
-	std::vector<double> needleFreq;
-	std::size_t sz;
+	double sampleRate;
 	std::size_t negativeSpace;
 	double shift;
 
 	std::size_t nextRec;
-	std::vector<double> results;
+	std::vector<double> calibration;
+
+	// Results are written into a small ring of whole frames (one step
+	// each, limited to the range gate) so that the most recently
+	// completed frame stays untouched while the next ones are filled
+	std::size_t stepSize;
+	std::size_t gateStart;
+	std::size_t frameSize;
+	arena_array<double> results;
+	arena_array<double> envelope;
+	arena_array<double> phase;
+	arena_array<double> floorScratch;
+	bool keepPhase;
+	arena_array<change> changes[FRAME_SLOTS];
+	std::size_t changeCounts[FRAME_SLOTS];
+	std::size_t writing;
+	std::size_t writtenCount;
+	std::size_t writeSlot;
+	std::size_t previousSlot;
+	std::atomic<std::uint64_t> published; // (frame index + 1) << 2 | slot
+
+	// Slow running mean / variance of the envelope for each range bin
+	arena_array<double> bgMean;
+	arena_array<double> bgVar;
+	bool keepBackground;
+	double bgRate;
+	double bgThreshold;
+	std::size_t bgFrames;
+	bool suppressUnchanged;
+
+	// Echoes and tracks are found after their frame is published, so
+	// they are kept in the frame's slot and published separately
+	std::vector<echo> found;
+	std::uint64_t foundGeneration;
+	arena_array<echo> echoSlots[FRAME_SLOTS];
+	arena_array<track> trackSlots[FRAME_SLOTS];
+	std::size_t echoCounts[FRAME_SLOTS];
+	std::size_t trackCounts[FRAME_SLOTS];
+	std::atomic<std::uint64_t> targetsPublished; // tag of their frame
+	// Bins before and after an echo which hold the engine's own sidelobes
+	std::size_t sidelobesBefore;
+	std::size_t sidelobesAfter;
+	echo_tracker tracker;
 	std::size_t calibrationTime;
 	std::size_t calibrationP;
 
+	// Other microphones hearing the same speaker, for direction finding
+	const searcher *reference;
+	std::vector<const searcher*> partners;
+	double micSpacing;
+	std::unique_ptr<fft> correlator;
+	arena_array<fft_complex> correlatorFreq;
+
+	bool in_gate(std::size_t t, std::size_t count) const {
+		// True if any of the count samples from t lands inside the gate
+		if(count >= stepSize) {
+			return true;
+		}
+		std::size_t p0 = (t - calibrationP) % stepSize;
+		std::size_t p1 = p0 + count;
+		std::size_t gateEnd = gateStart + frameSize;
+		return (
+			(p0 < gateEnd && p1 > gateStart) ||
+			(p1 > stepSize && p1 - stepSize > gateStart)
+		);
+	}
+
+	void store(std::size_t t, double re, double im) {
+		std::size_t u = t - calibrationP;
+		std::size_t step = u % stepSize;
+		if(step < gateStart || step >= gateStart + frameSize) {
+			return;
+		}
+		std::size_t frame = u / stepSize;
+		std::size_t p = step - gateStart;
+		if(frame != writing) {
+			changeCounts[writeSlot] = 0;
+			writing = frame;
+			writtenCount = 0;
+		}
+
+		// Increase power with d, since sound pressure tails off as d^-1
+		std::size_t o = writeSlot * frameSize + p;
+		double dist = double(step) + shift - double(negativeSpace);
+		double v = std::sqrt(re * re + im * im) * dist;
+		results[o] = re * dist;
+		envelope[o] = v;
+		if(!phase.empty()) {
+			phase[o] = std::atan2(im, re);
+		}
+
+		if(!bgMean.empty()) {
+			double d = v - bgMean[p];
+			bool warm = (double(bgFrames) * bgRate >= 1.0);
+			if(warm && d * d > bgThreshold * bgThreshold * bgVar[p]) {
+				change c = {p, v, d / std::sqrt(bgVar[p] + 1e-30)};
+				changes[writeSlot][changeCounts[writeSlot] ++] = c;
+			}
+			double a = std::max(bgRate, 1.0 / double(bgFrames + 1));
+			bgMean[p] += a * d;
+			bgVar[p] = (1 - a) * (bgVar[p] + a * d * d);
+		}
+
+		// Writes always move forwards, so a full count means complete
+		if(++ writtenCount == frameSize) {
+			finish_frame();
+		}
+	}
+
+	void finish_frame(void) {
+		if(!bgMean.empty()) {
+			++ bgFrames;
+		}
+		if(!suppressUnchanged || changeCounts[writeSlot] != 0) {
+			std::uint64_t generation = writing + 1;
+			published.store((generation << 2) | writeSlot, std::memory_order_release);
+			// Never reuse the two most recently published slots
+			std::size_t next = 0;
+			while(next == writeSlot || next == previousSlot) {
+				++ next;
+			}
+			previousSlot = writeSlot;
+			writeSlot = next;
+		}
+	}
+
+	double distance_weight(std::size_t p) const {
+		// Gain store() applied to frame bin p
+		return std::max(1.0, double(gateStart + p) + shift - double(negativeSpace));
+	}
+
+	double at(const double *frame, std::ptrdiff_t i) const {
+		std::ptrdiff_t n = std::ptrdiff_t(frameSize);
+		if(frameSize == stepSize) {
+			// frame covers the whole step, so it wraps around
+			return frame[((i % n) + n) % n];
+		}
+		return (i >= 0 && i < n) ? frame[i] : 0.0;
+	}
+
+	const double *latest(const arena_array<double> &data, std::uint64_t tag) const {
+		if((tag >> 2) == 0 || data.empty()) {
+			return nullptr;
+		}
+		return &data[(tag & 3) * frameSize];
+	}
+
 public:
 	searcher(
-		std::size_t size,
 		std::size_t resultsSize,
-		double sampleRate,
-		const recorder *rec,
-		const chirp &needle
+		double sampleRateP,
+		const recorder *rec
 	)
 		: r(rec)
-		, transformer(size)
-		, needleFreq(size*2)
-		, sz(size)
+		, sampleRate(sampleRateP)
 		, negativeSpace(40) // space to show to the left of the calibration mark
 		, shift(50) // estimated sample count between speaker and microphone (chosen for clarity; in reality probably closer to 10)
 		, nextRec(0)
-		, results(resultsSize, 0.0)
-		, calibrationTime(std::size_t(sampleRate * 2))
+		, calibration(resultsSize, 0.0)
+		, stepSize(resultsSize)
+		, gateStart(0)
+		, frameSize(resultsSize)
+		, results()
+		, envelope()
+		, phase()
+		, floorScratch()
+		, keepPhase(false)
+		, changes()
+		, changeCounts()
+		, writing(std::size_t(-1))
+		, writtenCount(0)
+		, writeSlot(0)
+		, previousSlot(1)
+		, published(0)
+		, bgMean()
+		, bgVar()
+		, keepBackground(false)
+		, bgRate(0)
+		, bgThreshold(0)
+		, bgFrames(0)
+		, suppressUnchanged(false)
+		, found()
+		, foundGeneration(0)
+		, echoSlots()
+		, trackSlots()
+		, echoCounts()
+		, trackCounts()
+		, targetsPublished(0)
+		, sidelobesBefore(0)
+		, sidelobesAfter(0)
+		, tracker()
+		, calibrationTime(std::size_t(sampleRateP * 2))
 		, calibrationP(0)
-	{
-		// Calculate frequency spectrum of ideal needle
-		auto posn = transformer.p();
-		auto freq = transformer.f();
-
-		for(std::size_t i = 0; i < sz; ++ i) {
-			posn[i][0] = needle.sample(double(i) / sampleRate);
-			posn[i][1] = 0;
-		}
-		transformer.pToF();
-		memcpy(&needleFreq[0], freq, sz * sizeof(fftw_complex));
-	}
+		, reference(nullptr)
+		, partners()
+		, micSpacing(0)
+		, correlator()
+		, correlatorFreq()
+	{}
 
 	searcher(const searcher&) = delete;
-	searcher(searcher&&) = default;
+	searcher(searcher&&) = delete;
 
 	searcher &operator=(const searcher&) = delete;
-	searcher &operator=(searcher&&) = default;
+	searcher &operator=(searcher&&) = delete;
 
-	void perform_calibration(void) {
+	virtual ~searcher(void) = default;
+
+	// Number of recorded samples needed from nextRec to run a batch
+	virtual std::size_t window(void) const = 0;
+	virtual void analyse_next_batch(void) = 0;
+
+	virtual void perform_calibration(void) {
 		// Find strongest signal to anchor against
 		// (will most likely be the immediate feedback loop timing)
 		calibrationP = 0;
 		double maxV = -1;
-		std::size_t rs = results.size();
+		std::size_t rs = stepSize;
 		for(std::size_t i = 0; i < rs; ++ i) {
-			double v = std::abs(results[i]);
+			double v = std::abs(calibration[i]);
 			if(v > maxV) {
 				calibrationP = i;
 				maxV = v;
@@ -114,13 +347,415 @@ public:
 		calibrationP = (calibrationP + rs - negativeSpace) % rs;
 	}
 
+	void set_range_gate(double minRange, double maxRange) {
+		// Only results between these distances (in metres) are kept;
+		// batches which fall entirely outside are skipped. Batches which
+		// overlap the gate still run a full-size transform: each output
+		// needs the whole kernel of input, so pruning would only save
+		// part of the inverse transform.
+		double scale = 2.0 / SPEED_OF_SOUND * sampleRate;
+		double offset = double(negativeSpace) - shift;
+		double b0 = std::max(0.0, std::min(double(stepSize), minRange * scale + offset));
+		double b1 = std::max(b0, std::min(double(stepSize), maxRange * scale + offset));
+		gateStart = std::size_t(b0);
+		frameSize = std::max(std::size_t(1), std::size_t(std::ceil(b1)) - gateStart);
+	}
+
+	void add_partner(searcher *partner, double spacing, arena &space) {
+		// Partners share our calibration so that their observations
+		// line up sample-for-sample with ours. Only searchers with
+		// partners need the direction-finding transform.
+		if(!correlator) {
+			correlator.reset(new fft(arena_fft(space, 128)));
+			correlatorFreq = space.allocate<fft_complex>(arena_section::work, 128);
+		}
+		partner->reference = this;
+		partners.push_back(partner);
+		micSpacing = spacing;
+	}
+
+	void track_background(double rate, double threshold, bool changesOnly) {
+		// Bins further than threshold standard deviations from their
+		// background are reported as changes; with changesOnly, frames
+		// without any changes are not published at all
+		keepBackground = true;
+		bgRate = rate;
+		bgThreshold = threshold;
+		bgFrames = 0;
+		suppressUnchanged = changesOnly;
+	}
+
+	void track_targets(double gate, double alpha, double beta) {
+		// gate in metres; alpha and beta weight the range and
+		// range-rate corrections from each new echo
+		tracker.configure(gate, alpha, beta);
+		tracker.clear();
+	}
+
+	void track_phase(bool enabled) {
+		keepPhase = enabled;
+	}
+
+	void allocate_frames(arena &space) {
+		// Called once the range gate, phase and background tracking
+		// are configured, so that every frame is sized exactly
+		std::size_t n = frameSize * FRAME_SLOTS;
+		std::size_t bg = keepBackground ? frameSize : 0;
+		results = space.allocate<double>(arena_section::raw, n);
+		envelope = space.allocate<double>(arena_section::envelope, n);
+		phase = space.allocate<double>(arena_section::phase, keepPhase ? n : 0);
+		floorScratch = space.allocate<double>(arena_section::work, frameSize);
+		bgMean = space.allocate<double>(arena_section::background, bg);
+		bgVar = space.allocate<double>(arena_section::background, bg);
+		for(std::size_t i = 0; i < FRAME_SLOTS; ++ i) {
+			changes[i] = space.allocate<change>(arena_section::background, bg);
+			changeCounts[i] = 0;
+			echoSlots[i] = space.allocate<echo>(arena_section::targets, MAX_ECHOES);
+			trackSlots[i] = space.allocate<track>(
+				arena_section::targets,
+				tracker.capacity(MAX_ECHOES)
+			);
+			echoCounts[i] = 0;
+			trackCounts[i] = 0;
+		}
+		found.reserve(MAX_ECHOES);
+	}
+
+	void restart(std::size_t position) {
+		nextRec = position;
+	}
+
+	void update(void) {
+		if(results.empty()) {
+			throw std::runtime_error("frames not allocated");
+		}
+		std::size_t latest = r->latest();
+		std::size_t cap = r->capacity();
+
+		if(latest > cap && nextRec < latest - cap) {
+			// must be falling behind; skip to current
+			std::cerr << "!";
+			nextRec = latest - window();
+		}
+
+		if(nextRec < calibrationTime) {
+			// Calibration stage; store raw sound data
+			std::size_t rs = stepSize;
+			while(nextRec < latest) {
+				calibration[nextRec%rs] = r->get(nextRec);
+				++ nextRec;
+			}
+			if(nextRec >= calibrationTime) {
+				perform_calibration();
+				std::vector<double>().swap(calibration);
+				if(reference != nullptr) {
+					calibrationP = reference->calibrationP;
+				}
+			}
+		} else {
+			// Runtime: deconvolve against needle to find echos
+			while(nextRec + window() <= latest) {
+				analyse_next_batch();
+			}
+		}
+	}
+
+	void find_echoes(void) {
+		// Only strong peaks are refined, so the cost of sub-sample
+		// precision grows with the number of echos, not the block size
+		const std::size_t window = 16;
+		const std::size_t zoom = 16;
+
+		std::uint64_t tag = published.load(std::memory_order_acquire);
+		const double *env = latest(envelope, tag);
+		const double *raw = latest(results, tag);
+		if(env == nullptr || (tag >> 2) == foundGeneration) {
+			// nothing new since last time
+			return;
+		}
+		found.clear();
+
+		// Noise floor from the median and median absolute deviation of
+		// the unweighted envelope, which (unlike the mean and spread)
+		// strong echoes barely move. Peaks must stand well clear of the
+		// floor's own variation, and at least 4x (12dB) above it.
+		std::size_t rs = frameSize;
+		std::size_t mid = rs / 2;
+		double *ordered = floorScratch.data();
+		for(std::size_t i = 0; i < rs; ++ i) {
+			ordered[i] = env[i] / distance_weight(i);
+		}
+		std::nth_element(ordered, ordered + mid, ordered + rs);
+		double noise = ordered[mid];
+		for(std::size_t i = 0; i < rs; ++ i) {
+			ordered[i] = std::abs(ordered[i] - noise);
+		}
+		std::nth_element(ordered, ordered + mid, ordered + rs);
+		double spread = ordered[mid] * 1.4826; // ~ standard deviation
+		double threshold = noise + std::max(spread * 6, noise * 3);
+
+		std::vector<std::pair<double, std::size_t>> peaks;
+		for(std::size_t i = 0; i < rs; ++ i) {
+			double v = env[i];
+			if(
+				v > threshold * distance_weight(i) &&
+				v >= at(env, std::ptrdiff_t(i) - 1) &&
+				v > at(env, std::ptrdiff_t(i) + 1)
+			) {
+				peaks.emplace_back(v, i);
+			}
+		}
+		std::sort(peaks.rbegin(), peaks.rend());
+
+		double win[window];
+		for(std::size_t n = 0; n < peaks.size() && found.size() < MAX_ECHOES; ++ n) {
+			std::size_t p = peaks[n].second;
+			// Skip the shoulders of stronger echoes, peaks much weaker
+			// than an echo nearby, and the engine's sidelobes (compared
+			// without the distance weighting, which would inflate them)
+			double own = peaks[n].first / distance_weight(p);
+			bool separate = true;
+			for(std::size_t j = 0; j < found.size(); ++ j) {
+				double d = double(p) - found[j].position;
+				if(frameSize == stepSize) {
+					// frame wraps around
+					d -= std::floor(d / double(rs) + 0.5) * double(rs);
+				}
+				double gap = std::abs(d);
+				double span = double((d < 0) ? sidelobesBefore : sidelobesAfter);
+				double other = found[j].strength / distance_weight(std::size_t(found[j].position));
+				if(
+					gap < double(window / 2) ||
+					(gap < double(window * 2) && own * 4 < other) ||
+					(gap < span && own * 20 < other) // 26dB
+				) {
+					separate = false;
+					break;
+				}
+			}
+			if(!separate) {
+				continue;
+			}
+
+			for(std::size_t i = 0; i < window; ++ i) {
+				win[i] = at(env, std::ptrdiff_t(p + i) - std::ptrdiff_t(window / 2));
+			}
+			double position = double(p) + refine_peak(win, window, zoom);
+			double delay = position + double(gateStart) + shift - double(negativeSpace);
+			echo e = {
+				position,
+				delay / sampleRate * SPEED_OF_SOUND * 0.5,
+				peaks[n].first,
+				find_bearing(raw, tag, p)
+			};
+			found.push_back(e);
+		}
+
+		double dt = double((tag >> 2) - foundGeneration) * double(stepSize) / sampleRate;
+		tracker.update(found, foundGeneration == 0 ? 0.0 : dt);
+		foundGeneration = tag >> 2;
+
+		// The frame's slot is not rewritten until two newer frames
+		// are published, so readers of older targets are unaffected
+		std::size_t slot = tag & 3;
+		const std::vector<track> &confirmed = tracker.tracks();
+		std::copy(found.begin(), found.end(), echoSlots[slot].data());
+		std::copy(confirmed.begin(), confirmed.end(), trackSlots[slot].data());
+		echoCounts[slot] = found.size();
+		trackCounts[slot] = confirmed.size();
+		targetsPublished.store(tag, std::memory_order_release);
+	}
+
+	double find_bearing(const double *raw, std::uint64_t tag, std::size_t p) {
+		// GCC-PHAT between this microphone and each partner, gated to a
+		// short window around the echo (a cross-spectrum of the whole
+		// block would mix every echo's time difference together).
+		// Microphones are assumed to be in a line, evenly spaced.
+		if(partners.empty()) {
+			return std::nan("");
+		}
+
+		std::size_t n = correlator->size();
+		std::size_t gate = n / 2;
+		fft_complex *own = correlatorFreq.data();
+		auto posn = correlator->p();
+		auto freq = correlator->f();
+
+		for(std::size_t i = 0; i < n; ++ i) {
+			posn[i][0] = (i < gate) ? at(raw, std::ptrdiff_t(p + i) - std::ptrdiff_t(gate / 2)) : 0;
+			posn[i][1] = 0;
+		}
+		correlator->pToF();
+		memcpy(own, freq, n * sizeof(fft_complex));
+
+		double sinSum = 0;
+		std::size_t count = 0;
+		for(std::size_t j = 0; j < partners.size(); ++ j) {
+			const searcher &partner = *partners[j];
+			std::uint64_t partnerTag = partner.published.load(std::memory_order_acquire);
+			if((partnerTag >> 2) != (tag >> 2)) {
+				// partner is mid-frame; skip rather than mix frames
+				continue;
+			}
+			const double *other = partner.latest(partner.results, partnerTag);
+			for(std::size_t i = 0; i < n; ++ i) {
+				posn[i][0] = (i < gate) ? at(other, std::ptrdiff_t(p + i) - std::ptrdiff_t(gate / 2)) : 0;
+				posn[i][1] = 0;
+			}
+			correlator->pToF();
+			phase_transform_freq(n, own, freq, freq);
+			correlator->fToP();
+
+			double spacing = micSpacing * double(j + 1);
+			std::size_t maxLag = std::min(
+				gate / 2,
+				std::size_t(std::ceil(spacing / SPEED_OF_SOUND * sampleRate))
+			);
+			std::size_t best = 0;
+			for(std::size_t l = 0; l <= maxLag * 2; ++ l) {
+				if(posn[(l + n - maxLag) % n][0] > posn[(best + n - maxLag) % n][0]) {
+					best = l;
+				}
+			}
+			double lag = double(best) - double(maxLag);
+			if(best > 0 && best < maxLag * 2) {
+				double l = posn[(best + n - maxLag - 1) % n][0];
+				double c = posn[(best + n - maxLag) % n][0];
+				double r = posn[(best + n - maxLag + 1) % n][0];
+				double d = l - 2 * c + r;
+				if(d < 0) {
+					lag += 0.5 * (l - r) / d;
+				}
+			}
+			sinSum += lag / sampleRate * SPEED_OF_SOUND / spacing;
+			++ count;
+		}
+		if(count == 0) {
+			return std::nan("");
+		}
+		return std::asin(std::max(-1.0, std::min(1.0, sinSum / double(count))));
+	}
+
+	bool is_calibrated(void) const {
+		return (nextRec >= calibrationTime);
+	}
+
+	std::uint64_t generation(void) const {
+		return published.load(std::memory_order_acquire) >> 2;
+	}
+
+	frame_view latest_frame(void) const {
+		frame_view view;
+		std::uint64_t tag = published.load(std::memory_order_acquire);
+		view.generation = tag >> 2;
+		if(view.generation != 0) {
+			std::size_t slot = tag & 3;
+			std::size_t ps = phase.empty() ? 0 : frameSize;
+			view.raw = const_span<double>(latest(results, tag), frameSize);
+			view.envelope = const_span<double>(latest(envelope, tag), frameSize);
+			view.phase = const_span<double>(latest(phase, tag), ps);
+			view.changes = const_span<change>(changes[slot].data(), changeCounts[slot]);
+			if(targetsPublished.load(std::memory_order_acquire) == tag) {
+				view.echoes = const_span<echo>(echoSlots[slot].data(), echoCounts[slot]);
+				view.tracks = const_span<track>(trackSlots[slot].data(), trackCounts[slot]);
+			}
+		}
+		return view;
+	}
+
+	const_span<double> observations(observation_type type) const {
+		frame_view view = latest_frame();
+		switch(type) {
+		case observation_type::envelope:
+			return view.envelope;
+		case observation_type::phase:
+			return view.phase;
+		default:
+			return view.raw;
+		}
+	}
+
+	const_span<echo> echoes(void) const {
+		std::uint64_t tag = targetsPublished.load(std::memory_order_acquire);
+		if((tag >> 2) == 0) {
+			return const_span<echo>();
+		}
+		return const_span<echo>(echoSlots[tag & 3].data(), echoCounts[tag & 3]);
+	}
+
+	const_span<track> tracks(void) const {
+		std::uint64_t tag = targetsPublished.load(std::memory_order_acquire);
+		if((tag >> 2) == 0) {
+			return const_span<track>();
+		}
+		return const_span<track>(trackSlots[tag & 3].data(), trackCounts[tag & 3]);
+	}
+};
+
+class deconvolution_searcher : public searcher {
+	fft transformer;
+	arena_array<fft_complex> needleFreq;
+	std::size_t sz;
+	std::size_t hop;
+	std::size_t offset;
+	double scaleFactor;
+
+public:
+	deconvolution_searcher(
+		std::size_t size,
+		std::size_t hopSize,
+		std::size_t resultsSize,
+		double sampleRate,
+		const recorder *rec,
+		const chirp &needle,
+		arena &space,
+		fft_backend backend = fft_backend::automatic
+	)
+		: searcher(resultsSize, sampleRate, rec)
+		, transformer(arena_fft(space, size, backend))
+		, needleFreq(space.allocate<fft_complex>(arena_section::coefficients, size))
+		, sz(size)
+		, hop(hopSize)
+		, offset(0)
+		, scaleFactor(1.0 / double(size)) // gain independent of kernel size
+	{
+		// Output i is the echo of a chirp starting at input sample i, so
+		// it is only free from circular wrap-around while the whole chirp
+		// fits in the kernel; take the hop from the middle of that region
+		std::size_t chirpSamples = std::size_t(std::ceil(needle.duration() * sampleRate));
+		if(chirpSamples + hop > sz) {
+			throw std::invalid_argument("hop too large for kernel");
+		}
+		offset = (sz - chirpSamples - hop) / 2;
+		sidelobesBefore = chirpSamples;
+		sidelobesAfter = chirpSamples;
+
+		// Calculate frequency spectrum of ideal needle
+		auto posn = transformer.p();
+		auto freq = transformer.f();
+
+		for(std::size_t i = 0; i < sz; ++ i) {
+			posn[i][0] = needle.sample(double(i) / sampleRate);
+			posn[i][1] = 0;
+		}
+		transformer.pToF();
+		memcpy(needleFreq.data(), freq, sz * sizeof(fft_complex));
+	}
+
+	std::size_t window(void) const {
+		return sz;
+	}
+
 	void analyse_next_batch(void) {
 		if(nextRec + sz > r->latest()) {
 			throw std::runtime_error("not enough data");
 		}
 
-		double dist0 = (shift - negativeSpace);
-		double scaleFactor = std::pow(sz, -0.5);
+		if(!in_gate(nextRec + offset, hop)) {
+			// nothing here is inside the range gate
+			nextRec += hop;
+			return;
+		}
 
 		auto posn = transformer.p();
 		auto freq = transformer.f();
@@ -133,64 +768,640 @@ public:
 		deconvolve_freq(
 			sz,
 			freq,
-			(fftw_complex*) &needleFreq[0],
+			needleFreq.data(),
 			freq,
 			100.0
 		);
+		to_analytic_freq(sz, freq);
 		transformer.fToP();
-		// splitting convolution into parts only works for middle half
-		std::size_t rs = results.size();
-		std::size_t p0 = nextRec + sz/4 - calibrationP;
-		for(std::size_t i = sz/4, e = i + sz/2; i < e; ++ i) {
-			std::size_t p = (p0 + i) % rs;
-			// Increase power with d, since sound pressure tails off as d^-1
-			double dist = p + dist0;
-			results[p] = posn[i%sz][0] * dist * scaleFactor;
+		for(std::size_t i = offset, e = i + hop; i < e; ++ i) {
+			store(nextRec + i, posn[i][0] * scaleFactor, posn[i][1] * scaleFactor);
 		}
-		nextRec += sz/2;
+		nextRec += hop;
 	}
+};
 
-	void update(void) {
-		std::size_t latest = r->latest();
-		std::size_t cap = r->capacity();
+class partitioned_searcher : public searcher {
+	// Uniformly partitioned overlap-save convolution: the deconvolution
+	// filter is split into equal blocks, and the spectra of past input
+	// blocks are kept in a frequency-domain delay line. Each batch costs
+	// one small forward and inverse FFT regardless of the chirp length.
+	fft transformer;
+	arena_array<fft_complex> filterFreq;
+	arena_array<fft_complex> delayLine;
+	std::size_t block;
+	std::size_t partitions;
+	std::size_t delayPos;
+	std::size_t latency;
+	double scaleFactor;
 
-		if(nextRec < latest - cap) {
-			// must be falling behind; skip to current
-			std::cerr << "!";
-			nextRec = latest - sz;
+public:
+	partitioned_searcher(
+		std::size_t size,
+		std::size_t blockSize,
+		std::size_t resultsSize,
+		double sampleRate,
+		const recorder *rec,
+		const chirp &needle,
+		arena &space
+	)
+		: searcher(resultsSize, sampleRate, rec)
+		, transformer(arena_fft(space, blockSize * 2))
+		, filterFreq(space.allocate<fft_complex>(
+			arena_section::coefficients,
+			(size + blockSize - 1) / blockSize * blockSize * 2
+		))
+		, delayLine(space.allocate<fft_complex>(
+			arena_section::coefficients,
+			(size + blockSize - 1) / blockSize * blockSize * 2
+		))
+		, block(blockSize)
+		, partitions((size + blockSize - 1) / blockSize)
+		, delayPos(0)
+		, latency(size / 2)
+		, scaleFactor(1.0 / double(blockSize * 2))
+	{
+		// The filter is centred on its delay, but truncating it leaves
+		// a faint tail for its whole length afterwards
+		sidelobesBefore = size / 2;
+		sidelobesAfter = size;
+
+		// Build the (regularised) deconvolution filter in full, then
+		// rotate it so that the non-causal half becomes a fixed delay
+		// (temporary, so not taken from the arena)
+		fft full(size);
+		auto posn = full.p();
+		auto freq = full.f();
+
+		for(std::size_t i = 0; i < size; ++ i) {
+			posn[i][0] = needle.sample(double(i) / sampleRate);
+			posn[i][1] = 0;
 		}
+		full.pToF();
+		std::vector<double> needleFreq(size*2);
+		memcpy(&needleFreq[0], freq, size * sizeof(fft_complex));
+
+		// Deconvolving a unit impulse gives the filter's own response
+		for(std::size_t i = 0; i < size; ++ i) {
+			freq[i][0] = 1;
+			freq[i][1] = 0;
+		}
+		deconvolve_freq(
+			size,
+			freq,
+			(fft_complex*) &needleFreq[0],
+			freq,
+			100.0
+		);
+		full.fToP();
+
+		std::size_t fsz = block * 2;
+		posn = transformer.p();
+		freq = transformer.f();
+		for(std::size_t n = 0; n < partitions; ++ n) {
+			for(std::size_t i = 0; i < fsz; ++ i) {
+				std::size_t k = n * block + i;
+				posn[i][0] = 0;
+				posn[i][1] = 0;
+				if(i < block && k < size) {
+					posn[i][0] = full.p()[(k + size - latency) % size][0] / double(size);
+				}
+			}
+			transformer.pToF();
+			memcpy(&filterFreq[n * fsz], freq, fsz * sizeof(fft_complex));
+		}
+	}
 
-		if(nextRec < calibrationTime) {
-			// Calibration stage; store raw sound data
-			std::size_t rs = results.size();
-			while(nextRec < latest) {
-				results[nextRec%rs] = r->get(nextRec);
-				++ nextRec;
+	std::size_t window(void) const {
+		return block;
+	}
+
+	void analyse_next_batch(void) {
+		if(nextRec + block > r->latest()) {
+			throw std::runtime_error("not enough data");
+		}
+
+		std::size_t fsz = block * 2;
+		auto posn = transformer.p();
+		auto freq = transformer.f();
+
+		// Previous block + new block
+		for(std::size_t i = 0; i < fsz; ++ i) {
+			posn[i][0] = r->get(nextRec + i - block);
+			posn[i][1] = 0;
+		}
+		transformer.pToF();
+
+		delayPos = (delayPos + partitions - 1) % partitions;
+		memcpy(&delayLine[delayPos * fsz], freq, fsz * sizeof(fft_complex));
+
+		std::size_t p0 = nextRec - latency;
+		if(!in_gate(p0, block)) {
+			// the delay line must always be fed, but the output here is
+			// outside the range gate, so skip the convolution itself
+			nextRec += block;
+			return;
+		}
+
+		for(std::size_t i = 0; i < fsz; ++ i) {
+			freq[i][0] = 0;
+			freq[i][1] = 0;
+		}
+		for(std::size_t n = 0; n < partitions; ++ n) {
+			std::size_t d = (delayPos + n) % partitions;
+			multiply_accumulate_freq(
+				fsz,
+				&delayLine[d * fsz],
+				&filterFreq[n * fsz],
+				freq
+			);
+		}
+		to_analytic_freq(fsz, freq);
+		transformer.fToP();
+
+		// Only the second half is free from circular wrap-around
+		for(std::size_t i = 0; i < block; ++ i) {
+			store(
+				p0 + i,
+				posn[block + i][0] * scaleFactor,
+				posn[block + i][1] * scaleFactor
+			);
+		}
+		nextRec += block;
+	}
+};
+
+class fmcw_searcher : public searcher {
+	// Continuous sweeps: mixing the microphone signal with the sweep
+	// being transmitted turns each echo into a constant beat frequency
+	// proportional to its delay, which one small FFT per sweep (after
+	// low-pass filtering and decimating the mixed signal) can resolve.
+	// An echo only beats at a single frequency while it and the
+	// reference are both in the same sweep, so each batch analyses the
+	// second half of a sweep (aligned to the direct path), which hears
+	// every delay up to half a sweep in full. Longer delays read as 0.
+	fft transformer;
+	arena_array<double> mixer;
+	arena_array<double> lowPass;
+	arena_array<double> input;
+	std::size_t sweepSize;
+	std::size_t maxDelay;
+	std::size_t span;
+	std::size_t decimation;
+	double binsPerSample;
+	double scaleFactor;
+
+	void dechirp(const double *samples, std::size_t mixerStart) {
+		// samples holds span samples, heard while the reference sweep
+		// was at mixerStart. The second-harmonic product of the mixing
+		// is itself a fast sweep, so the low-pass removes most of it.
+		std::size_t n = transformer.size();
+		std::size_t taps = lowPass.size();
+		std::size_t count = (span - taps) / decimation + 1;
+		auto posn = transformer.p();
+		for(std::size_t j = 0; j < n; ++ j) {
+			posn[j][0] = 0;
+			posn[j][1] = 0;
+		}
+		for(std::size_t j = 0; j < count; ++ j) {
+			const double *s = samples + j * decimation;
+			const double *m = &mixer[(mixerStart + j * decimation) * 2];
+			double re = 0;
+			double im = 0;
+			for(std::size_t k = 0; k < taps; ++ k) {
+				double v = s[k] * lowPass[k];
+				re += v * m[k * 2];
+				im += v * m[k * 2 + 1];
 			}
-			if(nextRec >= calibrationTime) {
-				perform_calibration();
+			// Hann window
+			double w = 0.5 - 0.5 * std::cos(2 * M_PI * (double(j) + 0.5) / double(count));
+			posn[j][0] = re * w;
+			posn[j][1] = im * w;
+		}
+		transformer.pToF();
+	}
+
+	double magnitude(double delay) const {
+		// Beats fall at negative frequencies (positive ones for
+		// negative delays); interpolate between bins
+		std::ptrdiff_t n = std::ptrdiff_t(transformer.size());
+		auto freq = transformer.f();
+		double k = delay * binsPerSample;
+		double k0 = std::floor(k);
+		double f = k - k0;
+		std::ptrdiff_t b0 = ((-std::ptrdiff_t(k0)) % n + n) % n;
+		std::ptrdiff_t b1 = ((-std::ptrdiff_t(k0) - 1) % n + n) % n;
+		double m0 = std::sqrt(freq[b0][0] * freq[b0][0] + freq[b0][1] * freq[b0][1]);
+		double m1 = std::sqrt(freq[b1][0] * freq[b1][0] + freq[b1][1] * freq[b1][1]);
+		return (m0 + (m1 - m0) * f) * scaleFactor;
+	}
+
+	static double max_beat(const chirp &sweep) {
+		// Beat frequency for a delay of d samples is bandwidth * d / size
+		return sweep.bandwidth() * 0.5;
+	}
+
+	static double transition(const chirp &sweep) {
+		return max_beat(sweep) * 0.5;
+	}
+
+	static std::size_t decimation_for(double sampleRate, const chirp &sweep) {
+		// Anything left above the filter's stop band must not alias
+		// back onto a beat
+		double stop = max_beat(sweep) + transition(sweep);
+		return std::max(std::size_t(1), std::size_t(sampleRate / (stop + max_beat(sweep))));
+	}
+
+	static std::size_t taps_for(double sampleRate, const chirp &sweep) {
+		// Blackman window: transition width is about 5.5 / taps
+		std::size_t n = std::size_t(std::ceil(5.5 * sampleRate / transition(sweep)));
+		return n | 1;
+	}
+
+	static std::size_t fft_size(std::size_t size, double sampleRate, const chirp &sweep) {
+		std::size_t s = size - max_delay(size);
+		std::size_t taps = taps_for(sampleRate, sweep);
+		if(s <= taps) {
+			throw std::invalid_argument("sweep too short for its low-pass filter");
+		}
+		std::size_t count = (s - taps) / decimation_for(sampleRate, sweep) + 1;
+		std::size_t n = count * 2; // zero-pad for smoother interpolation
+		while(!is_smooth(n)) {
+			++ n;
+		}
+		return n;
+	}
+
+public:
+	fmcw_searcher(
+		std::size_t size,
+		std::size_t resultsSize,
+		double sampleRate,
+		const recorder *rec,
+		const chirp &sweep,
+		arena &space
+	)
+		: searcher(resultsSize, sampleRate, rec)
+		, transformer(arena_fft(space, fft_size(size, sampleRate, sweep)))
+		, mixer(space.allocate<double>(arena_section::coefficients, size * 2))
+		, lowPass(space.allocate<double>(arena_section::coefficients, taps_for(sampleRate, sweep)))
+		, input(space.allocate<double>(arena_section::work, size - max_delay(size)))
+		, sweepSize(size)
+		, maxDelay(max_delay(size))
+		, span(size - max_delay(size))
+		, decimation(decimation_for(sampleRate, sweep))
+		, binsPerSample(0)
+		, scaleFactor(0)
+	{
+		double binHz = sampleRate / double(decimation) / double(transformer.size());
+		binsPerSample = sweep.bandwidth() / double(sweepSize) / binHz;
+		// Window leakage reaches every delay
+		sidelobesBefore = sweepSize;
+		sidelobesAfter = sweepSize;
+
+		// Mixing halves the amplitude, as does the Hann window, so a
+		// unit echo reads about 1
+		std::size_t count = (span - lowPass.size()) / decimation + 1;
+		scaleFactor = 4.0 / double(count);
+
+		for(std::size_t i = 0; i < sweepSize; ++ i) {
+			double phase = sweep.phase(double(i) / sampleRate);
+			mixer[i * 2] = std::cos(phase);
+			mixer[i * 2 + 1] = -std::sin(phase);
+		}
+
+		// Windowed-sinc low-pass (unity gain at DC), cut off half way
+		// through the transition band
+		std::size_t taps = lowPass.size();
+		double cutoff = (max_beat(sweep) + transition(sweep) * 0.5) / sampleRate;
+		double centre = double(taps - 1) * 0.5;
+		double sum = 0;
+		for(std::size_t k = 0; k < taps; ++ k) {
+			double x = double(k) - centre;
+			double h = (x == 0) ? 2 * cutoff : std::sin(2 * M_PI * cutoff * x) / (M_PI * x);
+			double r = 2 * M_PI * double(k) / double(taps - 1);
+			h *= 0.42 - 0.5 * std::cos(r) + 0.08 * std::cos(2 * r);
+			lowPass[k] = h;
+			sum += h;
+		}
+		for(std::size_t k = 0; k < taps; ++ k) {
+			lowPass[k] /= sum;
+		}
+	}
+
+	static std::size_t max_delay(std::size_t size) {
+		// Longest delay (in samples) heard coherently by every batch
+		return size / 2;
+	}
+
+	std::size_t window(void) const {
+		return span;
+	}
+
+	void perform_calibration(void) {
+		// Raw samples are meaningless here (the speaker never stops), so
+		// anchor against the strongest beat instead. The calibration
+		// buffer holds one sweep by (time % step): its second half hears
+		// delays up to maxDelay coherently, and its first half hears the
+		// rest (as negative delays, from the previous sweep).
+		std::size_t best = 0;
+		double maxV = -1;
+		dechirp(&calibration[maxDelay], maxDelay);
+		for(std::size_t i = 0; i <= maxDelay; ++ i) {
+			double v = magnitude(double(i));
+			if(v > maxV) {
+				best = i;
+				maxV = v;
 			}
-		} else {
-			// Runtime: deconvolve against needle to find echos
-			while(nextRec + sz <= latest) {
-				analyse_next_batch();
+		}
+		dechirp(&calibration[0], 0);
+		for(std::size_t i = maxDelay + 1; i < sweepSize; ++ i) {
+			double v = magnitude(double(i) - double(sweepSize));
+			if(v > maxV) {
+				best = i;
+				maxV = v;
 			}
 		}
+		calibrationP = (best + stepSize - negativeSpace) % stepSize;
 	}
 
-	bool is_calibrated(void) const {
-		return (nextRec >= calibrationTime);
+	void analyse_next_batch(void) {
+		// Batches start maxDelay after the direct path arrives, and mix
+		// against the sweep delayed to match it
+		std::size_t anchor = (calibrationP + negativeSpace + maxDelay) % sweepSize;
+		if(nextRec % sweepSize != anchor) {
+			nextRec += (anchor + sweepSize - nextRec % sweepSize) % sweepSize;
+			return;
+		}
+		if(nextRec + span > r->latest()) {
+			throw std::runtime_error("not enough data");
+		}
+		std::size_t first = nextRec - maxDelay - negativeSpace;
+		if(in_gate(first, negativeSpace + maxDelay + 1)) {
+			for(std::size_t i = 0; i < span; ++ i) {
+				input[i] = r->get(nextRec + i);
+			}
+			dechirp(&input[0], maxDelay);
+		}
+		for(std::size_t i = 0; i < sweepSize; ++ i) {
+			if(in_gate(first + i, 1)) {
+				double delay = double(i) - double(negativeSpace);
+				store(first + i, (delay <= double(maxDelay)) ? magnitude(delay) : 0.0, 0);
+			}
+		}
+		nextRec += sweepSize;
+	}
+};
+
+class mls_searcher : public searcher {
+	// Periodic maximum-length sequence: one period of the recording
+	// is the circular convolution of the room with the sequence, which
+	// a fast Hadamard transform inverts exactly (no regularisation).
+	mls_correlator hadamard;
+	arena_array<double> input;
+	arena_array<double> response;
+
+	std::size_t strongest(const double *samples) {
+		hadamard.correlate(samples, &response[0]);
+		std::size_t best = 0;
+		for(std::size_t i = 0; i < response.size(); ++ i) {
+			if(std::abs(response[i]) > std::abs(response[best])) {
+				best = i;
+			}
+		}
+		return best;
 	}
 
-	const std::vector<double> &observations(void) const {
-		return results;
+public:
+	mls_searcher(
+		std::size_t resultsSize,
+		double sampleRate,
+		const recorder *rec,
+		const mls_sequence &sequence,
+		arena &space
+	)
+		: searcher(resultsSize, sampleRate, rec)
+		, hadamard(
+			sequence.bits(),
+			space.allocate<std::size_t>(arena_section::coefficients, sequence.size() * 2).data(),
+			space.allocate<double>(arena_section::work, sequence.size() + 1).data()
+		)
+		, input(space.allocate<double>(arena_section::work, sequence.size()))
+		, response(space.allocate<double>(arena_section::work, sequence.size()))
+	{}
+
+	std::size_t window(void) const {
+		return input.size();
+	}
+
+	void perform_calibration(void) {
+		// The calibration buffer holds one whole period by
+		// (time % step), so it can be correlated directly
+		std::size_t best = strongest(&calibration[0]);
+		calibrationP = (best + stepSize - negativeSpace) % stepSize;
+	}
+
+	void analyse_next_batch(void) {
+		std::size_t length = input.size();
+		if(nextRec % length != 0) {
+			// Batches must line up with the start of a period
+			nextRec += length - nextRec % length;
+			return;
+		}
+		if(nextRec + length > r->latest()) {
+			throw std::runtime_error("not enough data");
+		}
+		if(!in_gate(nextRec, length)) {
+			nextRec += length;
+			return;
+		}
+
+		for(std::size_t i = 0; i < length; ++ i) {
+			input[i] = r->get(nextRec + i);
+		}
+		hadamard.correlate(&input[0], &response[0]);
+		for(std::size_t i = 0; i < length; ++ i) {
+			if(in_gate(nextRec + i, 1)) {
+				// Real impulse response; the envelope is its magnitude
+				store(nextRec + i, response[i], 0);
+			}
+		}
+		nextRec += length;
 	}
 };
 
+struct kernel_choice {
+	std::size_t size;
+	std::size_t hop;
+	fft_backend backend;
+	double samplesPerSecond;
+};
+
+double benchmark_kernel(
+	std::size_t size,
+	std::size_t hop,
+	std::size_t resultsSize,
+	double sampleRate,
+	const chirp &needle,
+	fft_backend backend,
+	double duration
+) {
+	arena space; // never reserved, so allocations come from the heap
+	recorder rec(std::max(std::size_t(sampleRate), size * 4), space);
+	for(std::size_t i = 0; i < rec.capacity(); ++ i) {
+		rec.record(std::rand() * 2.0 / RAND_MAX - 1.0, 0);
+	}
+	deconvolution_searcher s(size, hop, resultsSize, sampleRate, &rec, needle, space, backend);
+	s.allocate_frames(space);
+
+	typedef std::chrono::steady_clock clock;
+	auto begin = clock::now();
+	auto end = begin + std::chrono::duration<double>(duration);
+	std::size_t position = 0;
+	std::size_t samples = 0;
+	auto now = begin;
+	do {
+		if(position + size > rec.latest()) {
+			position = 0;
+		}
+		s.restart(position);
+		s.analyse_next_batch();
+		position += hop;
+		samples += hop;
+		now = clock::now();
+	} while(now < end);
+
+	return double(samples) / std::chrono::duration<double>(now - begin).count();
+}
+
+double kernel_distortion(
+	std::size_t size,
+	std::size_t hop,
+	std::size_t resultsSize,
+	double sampleRate,
+	const chirp &needle,
+	fft_backend backend
+) {
+	// A static, noise-free scene should give identical frames; any
+	// change between frames is wrap-around leaking into the output.
+	// Returns the largest change relative to the peak.
+	arena space;
+	recorder rec(resultsSize * 8, space);
+	double direct = needle.duration() / 4; // clear of the frame edge
+	for(std::size_t i = 0; i < rec.capacity(); ++ i) {
+		double t = double(i % resultsSize) / sampleRate - direct;
+		rec.record(needle.sample(t) + 0.5 * needle.sample(t - needle.duration()), 0);
+	}
+	deconvolution_searcher s(size, hop, resultsSize, sampleRate, &rec, needle, space, backend);
+	s.allocate_frames(space);
+
+	std::vector<double> previous;
+	double change = 0;
+	double peak = 0;
+	while(s.generation() < 5 && s.window() + hop <= rec.latest()) {
+		std::uint64_t generation = s.generation();
+		s.analyse_next_batch();
+		if(s.generation() == generation || s.generation() < 3) {
+			// the first frames may be incomplete
+			continue;
+		}
+		frame_view view = s.latest_frame();
+		if(!previous.empty()) {
+			for(std::size_t i = 0; i < view.envelope.size(); ++ i) {
+				change = std::max(change, std::abs(view.envelope[i] - previous[i]));
+				peak = std::max(peak, view.envelope[i]);
+			}
+		}
+		previous.assign(view.envelope.begin(), view.envelope.end());
+	}
+	return (peak > 0) ? (change / peak) : 1.0;
+}
+
+kernel_choice choose_kernel(
+	std::size_t chirpSamples,
+	std::size_t resultsSize,
+	double sampleRate,
+	const chirp &needle
+) {
+	// Kernel must be at least twice the size of the chirp, and each
+	// hop must fit in the wrap-free part of the output. Any smooth
+	// length is fast enough to be worth measuring, with each FFT
+	// backend which can handle it; the fastest candidate whose output
+	// is also stable is chosen. Sizes are spread a few per octave,
+	// and measuring stops once the time budget is spent.
+	const double maxDistortion = 0.01;
+	const double sizeRatio = std::pow(2.0, 0.25);
+	const double budget = 1.0; // seconds
+	std::size_t minSize = std::max(std::size_t(16), chirpSamples * 2);
+	std::size_t maxSize = minSize * 4;
+
+	typedef std::chrono::steady_clock clock;
+	auto deadline = clock::now() + std::chrono::duration<double>(budget);
+	kernel_choice best = {0, 0, fft_backend::automatic, 0.0};
+	std::size_t lastSize = 0;
+	for(std::size_t size = minSize; size <= maxSize; ++ size) {
+		if(!is_smooth(size) || double(size) < double(lastSize) * sizeRatio) {
+			continue;
+		}
+		if(best.size != 0 && clock::now() > deadline) {
+			break;
+		}
+		lastSize = size;
+		std::vector<fft_backend> backends = fft_backends(size);
+		std::size_t hops[] = {size / 2, (size - chirpSamples) / 2};
+		for(std::size_t j = 0; j < 2; ++ j) {
+			std::size_t h = hops[j];
+			if(
+				h == 0 || h > resultsSize || h + chirpSamples > size ||
+				(j > 0 && h == hops[0])
+			) {
+				continue;
+			}
+			for(std::size_t k = 0; k < backends.size(); ++ k) {
+				double rate = benchmark_kernel(
+					size, h,
+					resultsSize,
+					sampleRate,
+					needle,
+					backends[k],
+					0.02
+				);
+				if(rate <= best.samplesPerSecond) {
+					continue;
+				}
+				double distortion = kernel_distortion(
+					size, h,
+					resultsSize,
+					sampleRate,
+					needle,
+					backends[k]
+				);
+				if(distortion <= maxDistortion) {
+					best.size = size;
+					best.hop = h;
+					best.backend = backends[k];
+					best.samplesPerSecond = rate;
+				}
+			}
+		}
+	}
+	if(best.size == 0) {
+		throw std::runtime_error("no usable FFT kernel size");
+	}
+	return best;
+}
+
+enum class ranging_mode {
+	pulsed, // repeating chirps, deconvolved
+	continuous, // back-to-back sweeps, dechirped (FMCW)
+	sequence // maximum-length sequence, Hadamard-correlated
+};
+
 class echolocator_impl : public echolocator_internal {
-	std::vector<repeating_chirp> outputs;
+	std::vector<std::unique_ptr<signal_source>> outputs;
+	arena memory;
 	std::vector<recorder> inputs;
-	std::vector<searcher> searchers;
+	std::vector<std::unique_ptr<searcher>> searchers;
 	double secondsPerFrame;
 	double framesPerSecond;
 	PaStream *stream;
@@ -220,7 +1431,7 @@ class echolocator_impl : public echolocator_internal {
 		float *outputBuffer = static_cast<float*>(output);
 		for(std::size_t i = 0; i < frameCount; ++ i) {
 			for(std::size_t j = 0; j < n; ++ j) {
-				outputBuffer[i*n+j] = float(outputs[j].sample(tmOutput));
+				outputBuffer[i*n+j] = float(outputs[j]->sample(tmOutput));
 			}
 			tmOutput += secondsPerFrame;
 		}
@@ -258,6 +1469,7 @@ class echolocator_impl : public echolocator_internal {
 public:
 	inline echolocator_impl(int sample_rate)
 		: outputs()
+		, memory()
 		, inputs()
 		, secondsPerFrame(1.0 / sample_rate)
 		, framesPerSecond(sample_rate)
@@ -274,8 +1486,36 @@ public:
 
 		double step = 0.025;
 		double chirpDuration = 0.004;
+		ranging_mode mode = ranging_mode::pulsed;
+		std::size_t partitionSize = 0; // 0 = deconvolve with a single FFT
+		bool publishPhase = false;
+		bool changesOnly = false; // only publish frames which differ from the background
+		double micSpacing = 0.1; // metres between adjacent microphones
+		double rangeMin = 0; // metres; results outside this range are not kept (batches wholly outside are skipped)
+		double rangeMax = std::numeric_limits<double>::infinity();
+		double trackGate = 0.15; // metres an echo can move between frames and stay on its track
+		bool hugePages = false; // back pipeline memory with huge pages where supported
+		std::size_t sequenceOrder = 11; // MLS period is 2^order - 1 samples
+//		rangeMin = 0.2;
+//		rangeMax = 1.5;
 //		step = 2.5;
 //		chirpDuration = 0.4;
+//		chirpDuration = 0.05;
+//		partitionSize = 256;
+//		mode = ranging_mode::continuous;
+//		mode = ranging_mode::sequence;
+
+		if(mode == ranging_mode::continuous) {
+			// sweep for the whole step
+			chirpDuration = step;
+		}
+
+		mls_sequence sequence(sequenceOrder, 0.5, framesPerSecond);
+		if(mode == ranging_mode::sequence) {
+			// one whole period per step
+			step = double(sequence.size()) / framesPerSecond;
+			chirpDuration = step;
+		}
 
 		chirp baseChirp(
 			tone(1.0, 1000.0),
@@ -288,28 +1528,10 @@ public:
 			<< step << " seconds ("
 			<< (1.0 / step)
 			<< " pulses per second)"
-			<< std::endl
-			<< "Max detectable distance: ~"
-			<< (step * SPEED_OF_SOUND * 0.5)
-			<< " metres (assuming 1 speaker)"
 			<< std::endl;
 
 		// Calculated properties
 
-		// Kernel must be at least twice the size of the chirp,
-		// and should be PoT for best performance
-		std::size_t fftKernel = 16;
-		while(double(fftKernel) < 2 * chirpDuration * framesPerSecond) {
-			fftKernel <<= 1;
-		}
-		std::cerr
-			<< "Chirp samples: "
-			<< int(chirpDuration * framesPerSecond)
-			<< std::endl
-			<< "FFT kernel size: "
-			<< fftKernel
-			<< std::endl;
-
 		double framesPerStepRaw = framesPerSecond * step;
 		std::size_t framesPerStep = std::size_t(framesPerStepRaw + 0.5);
 		std::cerr << "Frames per step: " << framesPerStepRaw << std::endl;
@@ -317,10 +1539,68 @@ public:
 			std::cerr << "!!! WARNING: framesPerStep is not an integer; output will drift" << std::endl;
 		}
 
+		std::size_t maxDelay = framesPerStep;
+		if(mode == ranging_mode::continuous) {
+			// echoes later than half a sweep are not heard coherently
+			maxDelay = fmcw_searcher::max_delay(framesPerStep);
+		}
+		std::cerr
+			<< "Max detectable distance: ~"
+			<< (double(maxDelay) / framesPerSecond * SPEED_OF_SOUND * 0.5)
+			<< " metres (assuming 1 speaker)"
+			<< std::endl;
+
+		std::size_t chirpSamples = std::size_t(std::ceil(chirpDuration * framesPerSecond));
+		std::cerr
+			<< "Chirp samples: "
+			<< chirpSamples
+			<< std::endl;
+
+		kernel_choice kernel = {0, 0, fft_backend::automatic, 0.0};
+		if(mode == ranging_mode::sequence) {
+			std::cerr
+				<< "Maximum-length sequence: "
+				<< sequence.size()
+				<< " samples"
+				<< std::endl;
+		} else if(mode == ranging_mode::continuous) {
+			std::cerr
+				<< "Continuous sweep (FMCW); beat resolution: "
+				<< (framesPerSecond / baseChirp.bandwidth())
+				<< " samples"
+				<< std::endl;
+		} else if(partitionSize != 0) {
+			// Filter must cover twice the chirp, in whole partitions
+			kernel.size = ((chirpSamples * 2 + partitionSize - 1) / partitionSize) * partitionSize;
+			kernel.hop = partitionSize;
+			std::cerr
+				<< "Partitioned filter: "
+				<< (kernel.size / partitionSize) << " x "
+				<< partitionSize << " samples"
+				<< std::endl;
+		} else {
+			std::cerr << "Measuring FFT kernel sizes..." << std::endl;
+			kernel = choose_kernel(
+				chirpSamples,
+				framesPerStep,
+				framesPerSecond,
+				baseChirp
+			);
+			std::cerr
+				<< "FFT kernel size: "
+				<< kernel.size
+				<< " (hop " << kernel.hop << ", "
+				<< fft_backend_name(kernel.backend) << ", "
+				<< int(kernel.samplesPerSecond / framesPerSecond)
+				<< "x realtime per searcher)"
+				<< std::endl;
+		}
+
 		// Reset state
 		inputs.clear();
 		outputs.clear();
 		searchers.clear();
+		memory.reset();
 
 		// Load input/output device info
 		PaDeviceIndex inDevice = Pa_GetDefaultInputDevice();
@@ -330,7 +1610,8 @@ public:
 		const PaDeviceInfo *outDeviceInfo = Pa_GetDeviceInfo(outDevice);
 
 		// OSX reports 2 microphones, but they are identical
-		int inputCount = 1;//inDeviceInfo->maxInputChannels;
+		// (bearings will always be 0 in that case)
+		int inputCount = inDeviceInfo->maxInputChannels;
 		int outputCount = outDeviceInfo->maxOutputChannels;
 
 		std::cerr
@@ -366,36 +1647,98 @@ public:
 			throw std::runtime_error("Pa_IsFormatSupported returned false");
 		}
 
-		// Create microphone recorders
-		for(int i = 0; i < inputCount; ++ i) {
-			inputs.emplace_back(std::size_t(framesPerSecond));
-		}
-
 		// Create chirp generators
 		chirp silence(tone(0, 0), tone(0, 0), 0);
 		bool silenceNonZero = true;
 
 		for(int i = 0; i < outputCount; ++ i) {
-			outputs.emplace_back(
+			if(mode == ranging_mode::sequence && i == 0) {
+				outputs.emplace_back(new mls_sequence(sequence));
+				continue;
+			}
+			outputs.emplace_back(new repeating_chirp(
 				(silenceNonZero && i != 0) ? silence : baseChirp,
 				i * step / outputCount,
 				step
-			);
+			));
 		}
 
-		for(std::size_t o = 0; o < outputs.size(); ++ o) {
-			if(silenceNonZero && o != 0) {
-				continue;
+		// Recorder and searcher state all lives in one arena: build the
+		// pipeline once to measure it, then again inside a single block
+		auto build = [&](void) {
+			// Create microphone recorders
+			for(int i = 0; i < inputCount; ++ i) {
+				inputs.emplace_back(std::size_t(framesPerSecond), memory);
 			}
-			for(std::size_t i = 0; i < inputs.size(); ++ i) {
-				searchers.emplace_back(
-					fftKernel,
-					framesPerStep,
-					framesPerSecond,
-					&inputs[i], baseChirp
-				);
+
+			for(std::size_t o = 0; o < outputs.size(); ++ o) {
+				if(silenceNonZero && o != 0) {
+					continue;
+				}
+				std::size_t first = searchers.size();
+				for(std::size_t i = 0; i < inputs.size(); ++ i) {
+					if(mode == ranging_mode::sequence) {
+						searchers.emplace_back(new mls_searcher(
+							framesPerStep,
+							framesPerSecond,
+							&inputs[i], sequence,
+							memory
+						));
+					} else if(mode == ranging_mode::continuous) {
+						searchers.emplace_back(new fmcw_searcher(
+							framesPerStep,
+							framesPerStep,
+							framesPerSecond,
+							&inputs[i], baseChirp,
+							memory
+						));
+					} else if(partitionSize != 0) {
+						searchers.emplace_back(new partitioned_searcher(
+							kernel.size,
+							partitionSize,
+							framesPerStep,
+							framesPerSecond,
+							&inputs[i], baseChirp,
+							memory
+						));
+					} else {
+						searchers.emplace_back(new deconvolution_searcher(
+							kernel.size,
+							kernel.hop,
+							framesPerStep,
+							framesPerSecond,
+							&inputs[i], baseChirp,
+							memory,
+							kernel.backend
+						));
+					}
+					searchers.back()->set_range_gate(rangeMin, rangeMax);
+					searchers.back()->track_phase(publishPhase);
+					searchers.back()->track_targets(trackGate, 0.5, 0.2);
+					if(changesOnly) {
+						searchers.back()->track_background(0.02, 5.0, true);
+					}
+					searchers.back()->allocate_frames(memory);
+					if(i != 0) {
+						searchers[first]->add_partner(
+							searchers.back().get(),
+							micSpacing,
+							memory
+						);
+					}
+				}
 			}
-		}
+		};
+		build();
+		inputs.clear();
+		searchers.clear();
+		memory.reserve(hugePages);
+		build();
+		std::cerr
+			<< "Pipeline memory: "
+			<< memory.size()
+			<< " bytes"
+			<< std::endl;
 
 		error = Pa_OpenStream(
 			&stream,
@@ -419,13 +1762,17 @@ public:
 
 	void analyse(void) {
 		for(std::size_t i = 0; i < searchers.size(); ++ i) {
-			searchers[i].update();
+			searchers[i]->update();
+		}
+		// All microphones must be up-to-date before finding bearings
+		for(std::size_t i = 0; i < searchers.size(); ++ i) {
+			searchers[i]->find_echoes();
 		}
 	}
 
 	bool is_calibrated(void) const {
 		for(std::size_t i = 0; i < searchers.size(); ++ i) {
-			if(!searchers[i].is_calibrated()) {
+			if(!searchers[i]->is_calibrated()) {
 				return false;
 			}
 		}
@@ -436,8 +1783,27 @@ public:
 		return searchers.size();
 	}
 
-	const std::vector<double> &observations(std::size_t search) const {
-		return searchers[search].observations();
+	const_span<double> observations(
+		std::size_t search,
+		observation_type type
+	) const {
+		return searchers[search]->observations(type);
+	}
+
+	frame_view latest_frame(std::size_t search) const {
+		return searchers[search]->latest_frame();
+	}
+
+	std::uint64_t generation(std::size_t search) const {
+		return searchers[search]->generation();
+	}
+
+	const_span<echo> echoes(std::size_t search) const {
+		return searchers[search]->echoes();
+	}
+
+	const_span<track> tracks(std::size_t search) const {
+		return searchers[search]->tracks();
 	}
 
 	~echolocator_impl(void) {
@@ -451,6 +1817,8 @@ public:
 	}
 };
 
+}
+
 echolocator::echolocator(int sample_rate)
 	: impl(new echolocator_impl(sample_rate))
 {}
@@ -1,8 +1,91 @@
 #ifndef INCLUDED_AUDIO_HPP
 #define INCLUDED_AUDIO_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
-#include <vector>
+
+template <typename T>
+class const_span {
+	const T *b;
+	std::size_t n;
+
+public:
+	inline const_span(void) : b(nullptr), n(0) {}
+	inline const_span(const T *begin, std::size_t size) : b(begin), n(size) {}
+
+	inline const T *begin(void) const {
+		return b;
+	}
+
+	inline const T *end(void) const {
+		return b + n;
+	}
+
+	inline std::size_t size(void) const {
+		return n;
+	}
+
+	inline bool empty(void) const {
+		return n == 0;
+	}
+
+	inline const T &operator[](std::size_t i) const {
+		return b[i];
+	}
+};
+
+enum class observation_type {
+	raw, // deconvolved signal
+	envelope, // magnitude of the analytic signal
+	phase // argument of the analytic signal (if enabled)
+};
+
+struct echo {
+	double position; // index into observations, with sub-sample precision
+	double range; // metres (uncalibrated; see README)
+	double strength;
+	double bearing; // radians from broadside, towards higher channels (NaN if unknown)
+};
+
+struct track {
+	std::uint64_t id; // stable for the life of the track
+	double range; // metres (filtered)
+	double rate; // metres per second; positive when moving away
+	double strength; // of the latest echo
+	double bearing; // of the latest echo (NaN if unknown)
+	std::size_t age; // frames since the track started
+	std::size_t missed; // consecutive frames without an echo
+};
+
+struct change {
+	std::size_t position; // index into observations
+	double value; // envelope
+	double deviation; // standard deviations from the background
+};
+
+// A completed frame of observations. The engine never writes to a
+// frame until two newer frames have been published, so a view is
+// safe to read while generation(search) < view.generation + 2.
+struct frame_view {
+	std::uint64_t generation; // 0 until the first frame completes
+	const_span<double> raw;
+	const_span<double> envelope;
+	const_span<double> phase; // empty unless phase is enabled
+	const_span<change> changes; // empty unless background tracking is enabled
+	const_span<echo> echoes; // empty until analyse() has searched this frame
+	const_span<track> tracks;
+
+	inline frame_view(void)
+		: generation(0)
+		, raw()
+		, envelope()
+		, phase()
+		, changes()
+		, echoes()
+		, tracks()
+	{}
+};
 
 class echolocator_internal {
 public:
@@ -10,7 +93,14 @@ public:
 	virtual void analyse(void) = 0;
 	virtual bool is_calibrated(void) const = 0;
 	virtual std::size_t searches_count(void) const = 0;
-	virtual const std::vector<double> &observations(std::size_t search) const = 0;
+	virtual const_span<double> observations(
+		std::size_t search,
+		observation_type type
+	) const = 0;
+	virtual frame_view latest_frame(std::size_t search) const = 0;
+	virtual std::uint64_t generation(std::size_t search) const = 0;
+	virtual const_span<echo> echoes(std::size_t search) const = 0;
+	virtual const_span<track> tracks(std::size_t search) const = 0;
 
 	virtual ~echolocator_internal(void) = default;
 };
@@ -37,8 +127,27 @@ public:
 		return impl->searches_count();
 	}
 
-	inline const std::vector<double> &observations(std::size_t search) const {
-		return impl->observations(search);
+	inline const_span<double> observations(
+		std::size_t search,
+		observation_type type = observation_type::raw
+	) const {
+		return impl->observations(search, type);
+	}
+
+	inline frame_view latest_frame(std::size_t search) const {
+		return impl->latest_frame(search);
+	}
+
+	inline std::uint64_t generation(std::size_t search) const {
+		return impl->generation(search);
+	}
+
+	inline const_span<echo> echoes(std::size_t search) const {
+		return impl->echoes(search);
+	}
+
+	inline const_span<track> tracks(std::size_t search) const {
+		return impl->tracks(search);
 	}
 };
 
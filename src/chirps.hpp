@@ -2,6 +2,17 @@
 #define INCLUDED_CHIRPS_HPP
 
 #include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace echolocator_detail {
+
+class signal_source {
+public:
+	virtual double sample(double time) const = 0;
+	virtual ~signal_source(void) = default;
+};
 
 class tone {
 public:
@@ -31,7 +42,19 @@ public:
 			return 0;
 		}
 
-		return (a0 + time * aD) * std::sin(time * (f0 + time * fD));
+		return (a0 + time * aD) * std::sin(phase(time));
+	}
+
+	inline double phase(double time) const {
+		return time * (f0 + time * fD);
+	}
+
+	inline double bandwidth(void) const {
+		return std::abs(fD) * d / M_PI;
+	}
+
+	inline double duration(void) const {
+		return d;
 	}
 
 	inline chirp(tone start, tone end, double duration)
@@ -43,7 +66,7 @@ public:
 	{}
 };
 
-class repeating_chirp {
+class repeating_chirp : public signal_source {
 	chirp c;
 	double o;
 	double d;
@@ -64,4 +87,58 @@ public:
 	}
 };
 
+class mls_sequence : public signal_source {
+	// Maximum-length sequence: pseudo-random +/-1 noise repeating every
+	// 2^order - 1 samples, whose periodic autocorrelation is a spike
+	std::vector<unsigned char> b;
+	double amplitude;
+	double rate;
+
+public:
+	inline mls_sequence(std::size_t order, double amplitudeP, double sampleRate)
+		: b()
+		, amplitude(amplitudeP)
+		, rate(sampleRate)
+	{
+		// Feedback taps of primitive polynomials (Fibonacci LFSR)
+		static const unsigned TAPS[][4] = {
+			{2, 1, 0, 0}, {3, 2, 0, 0}, {4, 3, 0, 0}, {5, 3, 0, 0},
+			{6, 5, 0, 0}, {7, 6, 0, 0}, {8, 6, 5, 4}, {9, 5, 0, 0},
+			{10, 7, 0, 0}, {11, 9, 0, 0}, {12, 6, 4, 1}, {13, 4, 3, 1},
+			{14, 5, 3, 1}, {15, 14, 0, 0}, {16, 15, 13, 4}, {17, 14, 0, 0},
+			{18, 11, 0, 0}, {19, 6, 2, 1}, {20, 17, 0, 0}
+		};
+		if(order < 2 || order > 20) {
+			throw std::invalid_argument("unsupported MLS order");
+		}
+		const unsigned *taps = TAPS[order - 2];
+		std::size_t length = (std::size_t(1) << order) - 1;
+		b.assign(length, 1);
+		for(std::size_t n = order; n < length; ++ n) {
+			unsigned char v = 0;
+			for(std::size_t t = 0; t < 4 && taps[t] != 0; ++ t) {
+				v ^= b[n - taps[t]];
+			}
+			b[n] = v;
+		}
+	}
+
+	inline std::size_t size(void) const {
+		return b.size();
+	}
+
+	inline const std::vector<unsigned char> &bits(void) const {
+		return b;
+	}
+
+	inline double sample(double time) const {
+		double n = std::floor(time * rate + 0.5);
+		double l = double(b.size());
+		std::size_t i = std::size_t(n - std::floor(n / l) * l);
+		return b[i % b.size()] ? -amplitude : amplitude;
+	}
+};
+
+}
+
 #endif
@@ -1,15 +1,56 @@
 #ifndef INCLUDED_FOURIER_HPP
 #define INCLUDED_FOURIER_HPP
 
+#ifndef ECHOLOCATOR_NO_FFTW
 #include <fftw3.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace echolocator_detail {
+
+// Layout-compatible with fftw_complex
+typedef double fft_complex[2];
+
+inline bool is_power_of_two(std::size_t size) {
+	return size != 0 && (size & (size - 1)) == 0;
+}
+
+inline bool is_smooth(std::size_t size) {
+#ifdef ECHOLOCATOR_NO_FFTW
+	// The built-in engine is only fast for powers of two
+	return is_power_of_two(size);
+#else
+	// FFTW is fast for sizes made from small prime factors
+	if(size == 0) {
+		return false;
+	}
+	const std::size_t factors[] = {2, 3, 5, 7};
+	for(std::size_t i = 0; i < 4; ++ i) {
+		while(size % factors[i] == 0) {
+			size /= factors[i];
+		}
+	}
+	return size == 1;
+#endif
+}
 
-void deconvolve_freq(
+inline void deconvolve_freq(
 	std::size_t size,
-	const fftw_complex *num,
-	const fftw_complex *den,
-	fftw_complex *target,
+	const fft_complex *num,
+	const fft_complex *den,
+	fft_complex *target,
 	double dampingCheat
 ) {
 	for(std::size_t i = 0; i < size; ++ i) {
@@ -21,61 +62,562 @@ void deconvolve_freq(
 	}
 }
 
-class fft {
-	fftw_complex *pSpace;
-	fftw_complex *fSpace;
+inline void to_analytic_freq(std::size_t size, fft_complex *freq) {
+	// Dropping negative frequencies (and doubling positive ones to
+	// compensate) makes the inverse transform yield the analytic
+	// signal: the real part is unchanged, the imaginary part is its
+	// Hilbert transform.
+	std::size_t half = (size + 1) / 2;
+	for(std::size_t i = 1; i < half; ++ i) {
+		freq[i][0] *= 2;
+		freq[i][1] *= 2;
+	}
+	for(std::size_t i = size / 2 + 1; i < size; ++ i) {
+		freq[i][0] = 0;
+		freq[i][1] = 0;
+	}
+}
+
+inline void phase_transform_freq(
+	std::size_t size,
+	const fft_complex *a,
+	const fft_complex *b,
+	fft_complex *target
+) {
+	// Cross-spectrum a.b* with only the phase kept (GCC-PHAT weighting)
+	for(std::size_t i = 0; i < size; ++ i) {
+		double re = a[i][0] * b[i][0] + a[i][1] * b[i][1];
+		double im = a[i][1] * b[i][0] - a[i][0] * b[i][1];
+		double m = std::sqrt(re * re + im * im);
+		double scale = (m > 1e-12) ? (1.0 / m) : 0.0;
+		target[i][0] = re * scale;
+		target[i][1] = im * scale;
+	}
+}
+
+inline void multiply_accumulate_freq(
+	std::size_t size,
+	const fft_complex *a,
+	const fft_complex *b,
+	fft_complex *target
+) {
+	for(std::size_t i = 0; i < size; ++ i) {
+		target[i][0] += a[i][0] * b[i][0] - a[i][1] * b[i][1];
+		target[i][1] += a[i][0] * b[i][1] + a[i][1] * b[i][0];
+	}
+}
+
+inline double refine_peak(
+	const double *window,
+	std::size_t size,
+	std::size_t zoom
+) {
+	// Zoom transform: evaluate the band-limited interpolant of the
+	// window (an inverse DFT at fractional positions) on a fine grid
+	// spanning one sample either side of the centre, then finish with
+	// a parabolic fit. Returns the offset of the peak from the centre.
+	std::size_t half = size / 2;
+	std::vector<double> re(half + 1);
+	std::vector<double> im(half + 1);
+	for(std::size_t k = 0; k <= half; ++ k) {
+		double sr = 0;
+		double si = 0;
+		for(std::size_t i = 0; i < size; ++ i) {
+			double a = -2 * M_PI * double(k * i % size) / double(size);
+			sr += window[i] * std::cos(a);
+			si += window[i] * std::sin(a);
+		}
+		re[k] = sr;
+		im[k] = si;
+	}
+
+	std::size_t points = zoom * 2 + 1;
+	std::vector<double> mag(points);
+	std::size_t best = zoom;
+	for(std::size_t j = 0; j < points; ++ j) {
+		double t = double(half) + (double(j) - double(zoom)) / double(zoom);
+		double v = re[0];
+		for(std::size_t k = 1; k <= half; ++ k) {
+			double a = 2 * M_PI * double(k) * t / double(size);
+			double w = (k == half && size % 2 == 0) ? 1.0 : 2.0;
+			v += w * (re[k] * std::cos(a) - im[k] * std::sin(a));
+		}
+		mag[j] = std::abs(v);
+		if(mag[j] > mag[best]) {
+			best = j;
+		}
+	}
+
+	double offset = double(best) - double(zoom);
+	if(best > 0 && best + 1 < points) {
+		double l = mag[best - 1];
+		double c = mag[best];
+		double r = mag[best + 1];
+		double d = l - 2 * c + r;
+		if(d < 0) {
+			offset += 0.5 * (l - r) / d;
+		}
+	}
+	return offset / double(zoom);
+}
+
+class fft_engine {
+public:
+	// Out-of-place and unnormalised (like FFTW)
+	virtual void transform(
+		const fft_complex *input,
+		fft_complex *output,
+		bool inverse
+	) = 0;
+
+	virtual ~fft_engine(void) = default;
+};
+
+inline fft_complex *fft_alloc(std::size_t count) {
+	// Cache-line aligned, which also suits any SIMD width
+	void *p = nullptr;
+#ifdef _WIN32
+	p = _aligned_malloc(count * sizeof(fft_complex), 64);
+#else
+	if(posix_memalign(&p, 64, count * sizeof(fft_complex)) != 0) {
+		p = nullptr;
+	}
+#endif
+	if(p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return static_cast<fft_complex*>(p);
+}
+
+inline void fft_free(fft_complex *p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+inline void radix2_passes(
+	fft_complex *x,
+	std::size_t size,
+	const fft_complex *twiddles
+) {
+	// Decimation in time over bit-reversed data. Pairs of radix-2
+	// stages are fused into one radix-4 pass (half the trips through
+	// memory); odd log2 sizes finish with a single radix-2 pass.
+	// twiddles[h + k] = e^(-i.pi.k/h) for each stage half-width h.
+	std::size_t h = 1;
+	for(; h * 4 <= size; h *= 4) {
+		for(std::size_t b = 0; b < size; b += h * 4) {
+			for(std::size_t k = 0; k < h; ++ k) {
+				const double *w1 = twiddles[h + k];
+				const double *w2 = twiddles[h * 2 + k];
+				double *a0 = x[b + k];
+				double *a1 = x[b + k + h];
+				double *a2 = x[b + k + h * 2];
+				double *a3 = x[b + k + h * 3];
+
+				double b1r = a1[0] * w1[0] - a1[1] * w1[1];
+				double b1i = a1[0] * w1[1] + a1[1] * w1[0];
+				double b3r = a3[0] * w1[0] - a3[1] * w1[1];
+				double b3i = a3[0] * w1[1] + a3[1] * w1[0];
+
+				double s0r = a0[0] + b1r;
+				double s0i = a0[1] + b1i;
+				double s1r = a0[0] - b1r;
+				double s1i = a0[1] - b1i;
+				double s2r = a2[0] + b3r;
+				double s2i = a2[1] + b3i;
+				double s3r = a2[0] - b3r;
+				double s3i = a2[1] - b3i;
+
+				// Second stage twiddles are w2 and w2 * -i
+				double t2r = s2r * w2[0] - s2i * w2[1];
+				double t2i = s2r * w2[1] + s2i * w2[0];
+				double t3r = s3r * w2[1] + s3i * w2[0];
+				double t3i = s3i * w2[1] - s3r * w2[0];
+
+				a0[0] = s0r + t2r;
+				a0[1] = s0i + t2i;
+				a2[0] = s0r - t2r;
+				a2[1] = s0i - t2i;
+				a1[0] = s1r + t3r;
+				a1[1] = s1i + t3i;
+				a3[0] = s1r - t3r;
+				a3[1] = s1i - t3i;
+			}
+		}
+	}
+	if(h * 2 == size) {
+		for(std::size_t k = 0; k < h; ++ k) {
+			const double *w = twiddles[h + k];
+			double *a0 = x[k];
+			double *a1 = x[k + h];
+			double br = a1[0] * w[0] - a1[1] * w[1];
+			double bi = a1[0] * w[1] + a1[1] * w[0];
+			a1[0] = a0[0] - br;
+			a1[1] = a0[1] - bi;
+			a0[0] += br;
+			a0[1] += bi;
+		}
+	}
+}
+
+struct radix2_tables {
+	// Read on every transform; held by whoever owns the memory, and
+	// shareable between engines of the same size
+	const std::size_t *order;
+	const fft_complex *twiddles;
+
+	static void fill(std::size_t size, std::size_t *order, fft_complex *twiddles) {
+		std::size_t bits = 0;
+		while((std::size_t(1) << bits) < size) {
+			++ bits;
+		}
+		for(std::size_t i = 0; i < size; ++ i) {
+			std::size_t r = 0;
+			for(std::size_t j = 0; j < bits; ++ j) {
+				r |= ((i >> j) & 1) << (bits - 1 - j);
+			}
+			order[i] = r;
+		}
+		for(std::size_t h = 1; h < size; h *= 2) {
+			for(std::size_t k = 0; k < h; ++ k) {
+				double a = -M_PI * double(k) / double(h);
+				twiddles[h + k][0] = std::cos(a);
+				twiddles[h + k][1] = std::sin(a);
+			}
+		}
+	}
+};
+
+class radix2_table_source {
+public:
+	// Tables for a power-of-two size, which must outlive every engine
+	// given them
+	virtual radix2_tables tables(std::size_t size) = 0;
+
+	virtual ~radix2_table_source(void) = default;
+};
+
+inline void radix2_transform(
+	const fft_complex *input,
+	fft_complex *output,
+	std::size_t size,
+	const radix2_tables &tables,
+	bool inverse
+) {
+	// The inverse is the forward transform with real and imaginary
+	// parts swapped on the way in and out
+	std::size_t re = inverse ? 1 : 0;
+	const std::size_t *order = tables.order;
+	for(std::size_t i = 0; i < size; ++ i) {
+		output[i][0] = input[order[i]][re];
+		output[i][1] = input[order[i]][1 - re];
+	}
+	radix2_passes(output, size, tables.twiddles);
+	if(inverse) {
+		for(std::size_t i = 0; i < size; ++ i) {
+			std::swap(output[i][0], output[i][1]);
+		}
+	}
+}
+
+class radix2_engine : public fft_engine {
+	std::vector<std::size_t> ownOrder;
+	std::vector<double> ownTwiddles;
+	radix2_tables tables;
+	std::size_t sz;
+
+public:
+	// Tables come from source if given, otherwise they are built here
+	radix2_engine(std::size_t size, radix2_table_source *source)
+		: ownOrder(source ? 0 : size)
+		, ownTwiddles(source ? 0 : size * 2)
+		, tables()
+		, sz(size)
+	{
+		if(source) {
+			tables = source->tables(size);
+		} else {
+			radix2_tables::fill(size, &ownOrder[0], (fft_complex*) &ownTwiddles[0]);
+			tables.order = &ownOrder[0];
+			tables.twiddles = (const fft_complex*) &ownTwiddles[0];
+		}
+	}
+
+	radix2_engine(const radix2_engine&) = delete;
+	radix2_engine &operator=(const radix2_engine&) = delete;
+
+	void transform(const fft_complex *input, fft_complex *output, bool inverse) {
+		radix2_transform(input, output, sz, tables, inverse);
+	}
+};
+
+class bluestein_engine : public fft_engine {
+	// Any size, rewritten as a power-of-two circular convolution with
+	// a chirp. Only used when nothing faster is available.
+	radix2_engine inner;
+	std::size_t sz;
+	std::size_t padded;
+	bool owned;
+	fft_complex *chirp;
+	fft_complex *kernel;
+	fft_complex *a;
+	fft_complex *b;
+
+	static std::size_t padded_size(std::size_t size) {
+		std::size_t n = 1;
+		while(n < size * 2 - 1) {
+			n *= 2;
+		}
+		return n;
+	}
+
+public:
+	static std::size_t scratch_size(std::size_t size) {
+		// chirp, kernel and two work buffers
+		return size + padded_size(size) * 3;
+	}
+
+	// scratch (scratch_size(size) values) may be given by the caller;
+	// otherwise it is allocated here
+	bluestein_engine(
+		std::size_t size,
+		fft_complex *scratch,
+		radix2_table_source *source
+	)
+		: inner(padded_size(size), source)
+		, sz(size)
+		, padded(padded_size(size))
+		, owned(scratch == nullptr)
+		, chirp(owned ? fft_alloc(scratch_size(size)) : scratch)
+		, kernel(chirp + size)
+		, a(kernel + padded)
+		, b(a + padded)
+	{
+		// chirp[n] = e^(-i.pi.n^2/size)
+		for(std::size_t n = 0; n < sz; ++ n) {
+			double angle = -M_PI * double((n * n) % (sz * 2)) / double(sz);
+			chirp[n][0] = std::cos(angle);
+			chirp[n][1] = std::sin(angle);
+		}
+		for(std::size_t k = 0; k < padded; ++ k) {
+			a[k][0] = 0;
+			a[k][1] = 0;
+		}
+		for(std::size_t n = 0; n < sz; ++ n) {
+			a[n][0] = chirp[n][0];
+			a[n][1] = -chirp[n][1];
+			if(n != 0) {
+				a[padded - n][0] = chirp[n][0];
+				a[padded - n][1] = -chirp[n][1];
+			}
+		}
+		inner.transform(a, kernel, false);
+	}
+
+	bluestein_engine(const bluestein_engine&) = delete;
+	bluestein_engine &operator=(const bluestein_engine&) = delete;
+
+	void transform(const fft_complex *input, fft_complex *output, bool inverse) {
+		std::size_t re = inverse ? 1 : 0;
+		for(std::size_t n = 0; n < sz; ++ n) {
+			double xr = input[n][re];
+			double xi = input[n][1 - re];
+			a[n][0] = xr * chirp[n][0] - xi * chirp[n][1];
+			a[n][1] = xr * chirp[n][1] + xi * chirp[n][0];
+		}
+		for(std::size_t k = sz; k < padded; ++ k) {
+			a[k][0] = 0;
+			a[k][1] = 0;
+		}
+		inner.transform(a, b, false);
+		for(std::size_t k = 0; k < padded; ++ k) {
+			double xr = b[k][0];
+			double xi = b[k][1];
+			b[k][0] = xr * kernel[k][0] - xi * kernel[k][1];
+			b[k][1] = xr * kernel[k][1] + xi * kernel[k][0];
+		}
+		inner.transform(b, a, true);
+		double scale = 1.0 / double(padded);
+		for(std::size_t k = 0; k < sz; ++ k) {
+			double xr = a[k][0] * scale;
+			double xi = a[k][1] * scale;
+			output[k][re] = xr * chirp[k][0] - xi * chirp[k][1];
+			output[k][1 - re] = xr * chirp[k][1] + xi * chirp[k][0];
+		}
+	}
+
+	~bluestein_engine(void) {
+		if(owned) {
+			fft_free(chirp);
+		}
+	}
+};
+
+#ifndef ECHOLOCATOR_NO_FFTW
+class fftw_engine : public fft_engine {
 	fftw_plan forwardPlan;
 	fftw_plan reversePlan;
+
+public:
+	explicit fftw_engine(std::size_t size)
+		: forwardPlan(nullptr)
+		, reversePlan(nullptr)
+	{
+		// Plan on scratch space with the same alignment as the real
+		// buffers (FFTW_MEASURE overwrites its arrays)
+		fft_complex *a = fft_alloc(size);
+		fft_complex *b = fft_alloc(size);
+		forwardPlan = fftw_plan_dft_1d(int(size), a, b, FFTW_FORWARD, FFTW_MEASURE);
+		reversePlan = fftw_plan_dft_1d(int(size), a, b, FFTW_BACKWARD, FFTW_MEASURE);
+		fft_free(a);
+		fft_free(b);
+	}
+
+	fftw_engine(const fftw_engine&) = delete;
+	fftw_engine &operator=(const fftw_engine&) = delete;
+
+	void transform(const fft_complex *input, fft_complex *output, bool inverse) {
+		fftw_execute_dft(
+			inverse ? reversePlan : forwardPlan,
+			const_cast<fft_complex*>(input),
+			output
+		);
+	}
+
+	~fftw_engine(void) {
+		fftw_destroy_plan(forwardPlan);
+		fftw_destroy_plan(reversePlan);
+	}
+};
+#endif
+
+enum class fft_backend {
+	automatic, // FFTW if available, otherwise built-in
+	builtin,
+	fftw
+};
+
+inline const char *fft_backend_name(fft_backend backend) {
+	switch(backend) {
+	case fft_backend::builtin:
+		return "built-in";
+	case fft_backend::fftw:
+		return "FFTW";
+	default:
+		return "automatic";
+	}
+}
+
+inline std::vector<fft_backend> fft_backends(std::size_t size) {
+	// Backends worth benchmarking for this size
+	std::vector<fft_backend> backends;
+	if(is_power_of_two(size)) {
+		backends.push_back(fft_backend::builtin);
+	}
+#ifndef ECHOLOCATOR_NO_FFTW
+	backends.push_back(fft_backend::fftw);
+#endif
+	return backends;
+}
+
+inline bool uses_bluestein(std::size_t size, fft_backend backend) {
+#ifndef ECHOLOCATOR_NO_FFTW
+	if(backend != fft_backend::builtin) {
+		return false;
+	}
+#else
+	(void) backend;
+#endif
+	return !is_power_of_two(size);
+}
+
+inline std::size_t fft_scratch_size(std::size_t size, fft_backend backend) {
+	// Extra working space (in complex values) which the engine for
+	// this size and backend needs from the caller
+	if(uses_bluestein(size, backend)) {
+		return bluestein_engine::scratch_size(size);
+	}
+	return 0;
+}
+
+inline std::unique_ptr<fft_engine> make_fft_engine(
+	std::size_t size,
+	fft_backend backend,
+	fft_complex *scratch = nullptr,
+	radix2_table_source *tables = nullptr
+) {
+#ifdef ECHOLOCATOR_NO_FFTW
+	if(backend == fft_backend::fftw) {
+		throw std::runtime_error("built without FFTW");
+	}
+#else
+	if(backend != fft_backend::builtin) {
+		return std::unique_ptr<fft_engine>(new fftw_engine(size));
+	}
+#endif
+	if(!is_power_of_two(size)) {
+		return std::unique_ptr<fft_engine>(new bluestein_engine(size, scratch, tables));
+	}
+	return std::unique_ptr<fft_engine>(new radix2_engine(size, tables));
+}
+
+class fft {
+	fft_complex *pSpace;
+	fft_complex *fSpace;
+	std::unique_ptr<fft_engine> engine;
 	std::size_t sz;
+	bool owned;
 
 public:
-	fft(std::size_t size)
-		: pSpace((fftw_complex *) fftw_malloc(size * sizeof(fftw_complex)))
-		, fSpace((fftw_complex *) fftw_malloc(size * sizeof(fftw_complex)))
-		, forwardPlan(fftw_plan_dft_1d(
-			int(size),
-			pSpace,
-			fSpace,
-			FFTW_FORWARD,
-			FFTW_MEASURE
-		))
-		, reversePlan(fftw_plan_dft_1d(
-			int(size),
-			fSpace,
-			pSpace,
-			FFTW_BACKWARD,
-			FFTW_MEASURE
-		))
+	fft(std::size_t size, fft_backend backend = fft_backend::automatic)
+		: pSpace(fft_alloc(size))
+		, fSpace(fft_alloc(size))
+		, engine(make_fft_engine(size, backend))
 		, sz(size)
+		, owned(true)
+	{}
+
+	// Uses caller-owned buffers (which must be suitably aligned and
+	// outlive this object); scratch holds fft_scratch_size() values,
+	// and built-in engines take their tables from the given source
+	fft(
+		std::size_t size,
+		fft_complex *pBuffer,
+		fft_complex *fBuffer,
+		fft_backend backend = fft_backend::automatic,
+		fft_complex *scratch = nullptr,
+		radix2_table_source *tables = nullptr
+	)
+		: pSpace(pBuffer)
+		, fSpace(fBuffer)
+		, engine(make_fft_engine(size, backend, scratch, tables))
+		, sz(size)
+		, owned(false)
 	{}
 
 	fft(const fft&) = delete;
 	fft(fft &&c)
 		: pSpace(c.pSpace)
 		, fSpace(c.fSpace)
-		, forwardPlan(c.forwardPlan)
-		, reversePlan(c.reversePlan)
+		, engine(std::move(c.engine))
 		, sz(c.sz)
+		, owned(c.owned)
 	{
 		c.pSpace = nullptr;
 		c.fSpace = nullptr;
-		c.forwardPlan = nullptr;
-		c.reversePlan = nullptr;
 	}
 
 	fft &operator=(const fft&) = delete;
 	fft &operator=(fft &&c) {
-		pSpace = c.pSpace;
-		fSpace = c.fSpace;
-		forwardPlan = c.forwardPlan;
-		reversePlan = c.reversePlan;
+		std::swap(pSpace, c.pSpace);
+		std::swap(fSpace, c.fSpace);
+		std::swap(engine, c.engine);
+		std::swap(owned, c.owned);
 		sz = c.sz;
 
-		c.pSpace = nullptr;
-		c.fSpace = nullptr;
-		c.forwardPlan = nullptr;
-		c.reversePlan = nullptr;
-
 		return *this;
 	}
 
@@ -83,48 +625,45 @@ public:
 		return sz;
 	}
 
-	fftw_complex *p(void) {
+	fft_complex *p(void) {
 		return pSpace;
 	}
 
-	const fftw_complex *p(void) const {
+	const fft_complex *p(void) const {
 		return pSpace;
 	}
 
-	fftw_complex *f(void) {
+	fft_complex *f(void) {
 		return fSpace;
 	}
 
-	const fftw_complex *f(void) const {
+	const fft_complex *f(void) const {
 		return fSpace;
 	}
 
 	void pToF(void) {
-		fftw_execute(forwardPlan);
+		engine->transform(pSpace, fSpace, false);
 	}
 
 	void fToP(void) {
-		fftw_execute(reversePlan);
+		engine->transform(fSpace, pSpace, true);
 	}
 
 	~fft(void) {
-		if(forwardPlan != nullptr) {
-			fftw_destroy_plan(forwardPlan);
-			forwardPlan = nullptr;
-		}
-		if(reversePlan != nullptr) {
-			fftw_destroy_plan(reversePlan);
-			reversePlan = nullptr;
+		if(!owned) {
+			return;
 		}
 		if(pSpace != nullptr) {
-			fftw_free(pSpace);
+			fft_free(pSpace);
 			pSpace = nullptr;
 		}
 		if(fSpace != nullptr) {
-			fftw_free(fSpace);
+			fft_free(fSpace);
 			fSpace = nullptr;
 		}
 	}
 };
 
+}
+
 #endif
@@ -0,0 +1,106 @@
+#ifndef INCLUDED_HADAMARD_HPP
+#define INCLUDED_HADAMARD_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace echolocator_detail {
+
+inline void hadamard_transform(double *data, std::size_t size) {
+	// In-place fast Walsh-Hadamard transform (additions only)
+	for(std::size_t h = 1; h < size; h <<= 1) {
+		for(std::size_t i = 0; i < size; i += h * 2) {
+			for(std::size_t j = i, e = i + h; j < e; ++ j) {
+				double a = data[j];
+				double b = data[j + h];
+				data[j] = a + b;
+				data[j + h] = a - b;
+			}
+		}
+	}
+}
+
+class mls_correlator {
+	// Circular cross-correlation against a maximum-length sequence.
+	// Each bit of an MLS is a fixed linear (XOR) function of any
+	// window of 'order' bits, so the correlation matrix is a permuted
+	// Hadamard matrix: permute in, transform, permute out.
+	std::size_t length;
+	std::size_t *tagIn;
+	std::size_t *tagOut;
+	double *space;
+
+public:
+	// tables must hold bits.size() * 2 values and workspace
+	// bits.size() + 1; both must outlive this object
+	mls_correlator(
+		const std::vector<unsigned char> &bits,
+		std::size_t *tables,
+		double *workspace
+	)
+		: length(bits.size())
+		, tagIn(tables)
+		, tagOut(tables + bits.size())
+		, space(workspace)
+	{
+		std::size_t order = 0;
+		while((std::size_t(1) << order) <= length) {
+			++ order;
+		}
+
+		// Input permutation: the window of bits starting at each sample
+		std::vector<std::size_t> unit(order, 0);
+		for(std::size_t n = 0; n < length; ++ n) {
+			std::size_t tag = 0;
+			for(std::size_t j = 0; j < order; ++ j) {
+				tag |= std::size_t(bits[(n + j) % length]) << j;
+			}
+			tagIn[n] = tag;
+			for(std::size_t j = 0; j < order; ++ j) {
+				if(tag == (std::size_t(1) << j)) {
+					unit[j] = n;
+				}
+			}
+		}
+
+		// Output permutation: the XOR mask giving the bit 'lag' samples
+		// before any window, read off from the single-bit windows
+		for(std::size_t lag = 0; lag < length; ++ lag) {
+			std::size_t tag = 0;
+			for(std::size_t j = 0; j < order; ++ j) {
+				tag |= std::size_t(bits[(unit[j] + length - lag) % length]) << j;
+			}
+			tagOut[lag] = tag;
+		}
+	}
+
+	std::size_t size(void) const {
+		return length;
+	}
+
+	void correlate(const double *input, double *output) {
+		// output[lag] = impulse response at lag, for input which is
+		// one period of (MLS played periodically) convolved with it
+		space[0] = 0;
+		for(std::size_t n = 0; n < length; ++ n) {
+			space[tagIn[n]] = input[n];
+		}
+		hadamard_transform(space, length + 1);
+		double scale = 1.0 / double(length + 1);
+		double sum = 0;
+		for(std::size_t lag = 0; lag < length; ++ lag) {
+			output[lag] = space[tagOut[lag]] * scale;
+			sum += output[lag];
+		}
+
+		// The sequence has one more -1 than +1, which leaves every lag
+		// offset by a fraction of the total response; undo it exactly
+		for(std::size_t lag = 0; lag < length; ++ lag) {
+			output[lag] += sum;
+		}
+	}
+};
+
+}
+
+#endif
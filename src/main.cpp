@@ -2,50 +2,101 @@
 #include "audio.hpp"
 #include "chirps.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <iostream>
 #include <memory>
+#include <vector>
+
+using echolocator_detail::chirp;
+using echolocator_detail::repeating_chirp;
+using echolocator_detail::tone;
 
 unsigned char to_saturated_char(double v, double low, double high) {
 	double scaled = (v - low) * 256.0 / (high - low);
 	return (unsigned char) std::max(0.0, std::min(255.5, scaled));
 }
 
+std::vector<unsigned char> build_colour_map(void) {
+	// White for silence, through blue, to near-black for strong echos
+	const double stops[3][3] = {
+		{255, 255, 255},
+		{40, 110, 220},
+		{0, 0, 30}
+	};
+	std::vector<unsigned char> map(256 * 3);
+	for(std::size_t i = 0; i < 256; ++ i) {
+		double t = double(i) * 2.0 / 255.0;
+		std::size_t seg = std::min(std::size_t(1), std::size_t(t));
+		double f = t - double(seg);
+		for(std::size_t c = 0; c < 3; ++ c) {
+			double v = stops[seg][c] + (stops[seg + 1][c] - stops[seg][c]) * f;
+			map[i * 3 + c] = (unsigned char) (v + 0.5);
+		}
+	}
+	return map;
+}
+
+inline double max_of(const double *values, std::size_t count) {
+	// Independent lanes allow the compiler to vectorise the reduction
+	double m[4] = {values[0], values[0], values[0], values[0]};
+	std::size_t i = 0;
+	for(; i + 4 <= count; i += 4) {
+		for(std::size_t j = 0; j < 4; ++ j) {
+			m[j] = std::max(m[j], values[i + j]);
+		}
+	}
+	for(; i < count; ++ i) {
+		m[0] = std::max(m[0], values[i]);
+	}
+	return std::max(std::max(m[0], m[1]), std::max(m[2], m[3]));
+}
+
 void render_locator_to_output(const echolocator &locator, bitmap_window &output) {
+	static const std::vector<unsigned char> colours = build_colour_map();
+
 	std::size_t n = locator.searches_count();
 	auto &dat = output.image_data();
 	std::size_t w = std::size_t(output.width());
 	std::size_t bandh = std::size_t(output.height()) / n;
-	double scale = 0.5;
+	std::vector<double> columns(w);
 
 	// For each observer
 	for(std::size_t i = 0; i < n; ++ i) {
-		const auto &obs = locator.observations(i);
+		const_span<double> obs = locator.observations(i, observation_type::envelope);
+		if(obs.empty()) {
+			continue;
+		}
+		std::size_t bins = obs.size();
 
-		// Normalise range of outputs (control for volume & damping)
+		// Max-pool bins into columns so that narrow echos are never
+		// skipped, and normalise range of outputs (control for volume
+		// & damping) from the same pass
 		double sum = 0;
 		double sum2 = 0;
 		for(std::size_t x = 0; x < w; ++ x) {
-			double v = std::abs(obs[std::size_t(x*scale)]);
+			std::size_t b0 = std::min(bins - 1, x * bins / w);
+			std::size_t b1 = std::max(b0 + 1, (x + 1) * bins / w);
+			double v = max_of(&obs[b0], b1 - b0);
+			columns[x] = v;
 			sum += v;
 			sum2 += v * v;
 		}
-		double avg = sum / w;
-		double variance = sum2 / w - avg * avg;
-		double sd = std::sqrt(variance);
+		double avg = sum / double(w);
+		double variance = sum2 / double(w) - avg * avg;
+		double sd = std::sqrt(std::max(0.0, variance));
 
-		// Render
+		// Render one row, then replicate it for the rest of the band
+		unsigned char *row = &dat[i * bandh * w * 3];
 		for(std::size_t x = 0; x < w; ++ x) {
-			unsigned char v = to_saturated_char(
-				std::abs(obs[std::size_t(x*scale)]),
-				avg,
-				avg + sd * 3
-			);
-			for(std::size_t y = 0; y < bandh; ++ y) {
-				std::size_t p = (i * bandh + y) * w + x;
-				dat[p] = 255 - v;
-			}
+			unsigned char v = to_saturated_char(columns[x], avg, avg + sd * 3);
+			memcpy(row + x * 3, &colours[v * 3u], 3);
+		}
+		for(std::size_t y = 1; y < bandh; ++ y) {
+			memcpy(row + y * w * 3, row, w * 3);
 		}
 	}
 }
@@ -66,7 +117,10 @@ int main(int argc, char **argv) {
 
 		for(double x = 0; x < 1024; x += 0.01) {
 			double y = test.sample(x) + output.height() / 2;
-			output.image_data()[std::size_t(y) * 1024 + std::size_t(x)] = 255;
+			std::size_t p = (std::size_t(y) * 1024 + std::size_t(x)) * 3;
+			for(std::size_t c = 0; c < 3; ++ c) {
+				output.image_data()[p + c] = 255;
+			}
 		}
 
 		std::cerr << "Creating echolocator..." << std::endl;
@@ -31,9 +31,9 @@ void bitmap_window::display(void) {
 	}
 	glTexImage2D(
 		GL_TEXTURE_2D, 0,
-		GL_LUMINANCE,
+		GL_RGB,
 		w, h, 0,
-		GL_LUMINANCE,
+		GL_RGB,
 		GL_UNSIGNED_BYTE, &img[0]
 	);
 	glVertexPointer(2, GL_FLOAT, 0, FS_VERTICES);
@@ -56,7 +56,7 @@ void bitmap_window::initialise(int *argc, char **argv) {
 bitmap_window::bitmap_window(int width, int height, const char *title)
 	: w(width)
 	, h(height)
-	, img(std::size_t(w * h), 0)
+	, img(std::size_t(w * h * 3), 0)
 	, data(nullptr)
 	, exitFunc(nullptr)
 {
@@ -90,6 +90,7 @@ void bitmap_window::run(void) {
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glEnable(GL_TEXTURE_2D);
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
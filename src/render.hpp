@@ -24,7 +24,7 @@ class bitmap_window {
 
 	int w;
 	int h;
-	std::vector<unsigned char> img;
+	std::vector<unsigned char> img; // RGB, 3 bytes per pixel
 	void *data;
 	std::unique_ptr<fn_wrapper> displayFunc;
 	std::unique_ptr<fn_wrapper> exitFunc;
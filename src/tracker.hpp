@@ -0,0 +1,159 @@
+#ifndef INCLUDED_TRACKER_HPP
+#define INCLUDED_TRACKER_HPP
+
+#include "audio.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace echolocator_detail {
+
+class echo_tracker {
+	// Follows echoes from frame to frame: each track predicts where
+	// its echo will be, claims the nearest echo within the gate, and
+	// corrects its range and range-rate with an alpha-beta filter.
+	// Work per frame depends only on the number of echoes and tracks.
+	struct state {
+		track t;
+		std::size_t hits;
+		bool claimed;
+	};
+
+	std::vector<state> active;
+	std::vector<track> confirmed;
+	std::vector<std::pair<double, std::pair<std::size_t, std::size_t>>> pairs;
+	std::vector<bool> used;
+	std::uint64_t nextId;
+	double gate;
+	double alpha;
+	double beta;
+	std::size_t confirmHits;
+	std::size_t maxMissed;
+
+public:
+	echo_tracker(void)
+		: active()
+		, confirmed()
+		, pairs()
+		, used()
+		, nextId(1)
+		, gate(0.15) // metres an echo may stray from its prediction
+		, alpha(0.5)
+		, beta(0.2)
+		, confirmHits(3) // frames before a track is published
+		, maxMissed(5) // frames a track can coast without an echo
+	{}
+
+	void configure(double gateP, double alphaP, double betaP) {
+		gate = gateP;
+		alpha = alphaP;
+		beta = betaP;
+	}
+
+	std::size_t capacity(std::size_t echoesPerFrame) const {
+		// Each frame's echoes claim or start at most one track apiece,
+		// and a track coasts for at most maxMissed frames
+		return echoesPerFrame * (maxMissed + 1);
+	}
+
+	void clear(void) {
+		active.clear();
+		confirmed.clear();
+	}
+
+	void update(const std::vector<echo> &echoes, double dt) {
+		// Predict
+		for(std::size_t i = 0; i < active.size(); ++ i) {
+			active[i].t.range += active[i].t.rate * dt;
+			active[i].claimed = false;
+		}
+
+		// Associate: closest gated pairs first
+		pairs.clear();
+		for(std::size_t i = 0; i < active.size(); ++ i) {
+			for(std::size_t j = 0; j < echoes.size(); ++ j) {
+				double d = std::abs(echoes[j].range - active[i].t.range);
+				if(d < gate) {
+					pairs.emplace_back(d, std::make_pair(i, j));
+				}
+			}
+		}
+		std::sort(pairs.begin(), pairs.end());
+		used.assign(echoes.size(), false);
+
+		// Correct
+		for(std::size_t n = 0; n < pairs.size(); ++ n) {
+			state &s = active[pairs[n].second.first];
+			std::size_t j = pairs[n].second.second;
+			if(s.claimed || used[j]) {
+				continue;
+			}
+			s.claimed = true;
+			used[j] = true;
+			const echo &e = echoes[j];
+			double residual = e.range - s.t.range;
+			s.t.range += alpha * residual;
+			if(dt > 0) {
+				s.t.rate += beta * residual / dt;
+			}
+			s.t.strength = e.strength;
+			s.t.bearing = e.bearing;
+			s.t.missed = 0;
+			++ s.hits;
+		}
+
+		// Age out lost tracks, then start new ones from spare echoes
+		std::size_t kept = 0;
+		for(std::size_t i = 0; i < active.size(); ++ i) {
+			state &s = active[i];
+			++ s.t.age;
+			if(!s.claimed && ++ s.t.missed > maxMissed) {
+				continue;
+			}
+			active[kept ++] = s;
+		}
+		active.resize(kept);
+
+		for(std::size_t j = 0; j < echoes.size(); ++ j) {
+			if(used[j]) {
+				continue;
+			}
+			state s;
+			s.t.id = 0;
+			s.t.range = echoes[j].range;
+			s.t.rate = 0;
+			s.t.strength = echoes[j].strength;
+			s.t.bearing = echoes[j].bearing;
+			s.t.age = 0;
+			s.t.missed = 0;
+			s.hits = 1;
+			s.claimed = true;
+			active.push_back(s);
+		}
+
+		// IDs are only handed out once a track is confirmed
+		confirmed.clear();
+		for(std::size_t i = 0; i < active.size(); ++ i) {
+			state &s = active[i];
+			if(s.hits < confirmHits) {
+				continue;
+			}
+			if(s.t.id == 0) {
+				s.t.id = nextId ++;
+			}
+			confirmed.push_back(s.t);
+		}
+	}
+
+	const std::vector<track> &tracks(void) const {
+		return confirmed;
+	}
+};
+
+}
+
+#endif